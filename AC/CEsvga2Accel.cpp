@@ -243,6 +243,14 @@ uint32_t GMR_VRAM(void)
 HIDDEN
 void CLASS::Cleanup()
 {
+	flushGMRCache();
+	flushShaderPrograms();
+	if (m_gmr_desc_pool) {
+		m_gmr_desc_pool->complete();
+		m_gmr_desc_pool->release();
+		m_gmr_desc_pool = 0;
+		m_gmr_desc_pool_pages = 0U;
+	}
 #if __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ >= 1060
 	if (m_surface_root) {
 		m_surface_root->release();
@@ -363,6 +371,12 @@ void CLASS::processOptions()
 		ce1_options_ac &= ~CE1_OPTION_AC_GL_CONTEXT;
 	if (PE_parse_boot_argn("-ce1_qe", &boot_arg, sizeof boot_arg))
 		ce1_options_ac |= CE1_OPTION_AC_QE;
+	if (PE_parse_boot_argn("-ce1_host_mipmaps", &boot_arg, sizeof boot_arg))
+		ce1_options_ac |= CE1_OPTION_AC_HOST_MIPMAPS;
+	if (PE_parse_boot_argn("-ce1_gl_host_copies", &boot_arg, sizeof boot_arg))
+		ce1_options_ac |= CE1_OPTION_AC_GL_HOST_COPIES;
+	if (PE_parse_boot_argn("-ce1_gl_translate_ps", &boot_arg, sizeof boot_arg))
+		ce1_options_ac |= CE1_OPTION_AC_GL_TRANSLATE_PS;
 	if (checkOptionAC(CE1_OPTION_AC_QE))
 		ce1_options_ac |= CE1_OPTION_AC_GL_CONTEXT;
 	setProperty("CECLSVGAAccelOptions", static_cast<uint64_t>(ce1_options_ac), 32U);
@@ -381,6 +395,24 @@ void CLASS::processOptions()
 		m_log_level_gld = static_cast<int>(boot_arg);
 		setProperty("CECLSVGAGLDLogLevel", static_cast<uint64_t>(m_log_level_gld), 32U);
 	}
+	/*
+	 * Host memory for GL textures in MB, 0 for no limit
+	 */
+	if (PE_parse_boot_argn("ce1_texture_budget", &boot_arg, sizeof boot_arg)) {
+		m_texture_budget = static_cast<size_t>(boot_arg) << 20;
+		setProperty("CECLSVGATextureBudget", static_cast<uint64_t>(boot_arg), 32U);
+	}
+	/*
+	 * Command buffers per GL context, 1 for no pipelining
+	 */
+	if (PE_parse_boot_argn("ce1_gl_cmd_buffers", &boot_arg, sizeof boot_arg)) {
+		m_gl_command_buffers = static_cast<uint32_t>(boot_arg);
+		if (m_gl_command_buffers < 1U)
+			m_gl_command_buffers = 1U;
+		else if (m_gl_command_buffers > GL_COMMAND_BUFFERS_MAX)
+			m_gl_command_buffers = GL_COMMAND_BUFFERS_MAX;
+		setProperty("CECLSVGAGLCommandBuffers", static_cast<uint64_t>(m_gl_command_buffers), 32U);
+	}
 }
 
 HIDDEN
@@ -458,6 +490,11 @@ IOReturn CLASS::setupAllocator()
 		s = bytes_reserve;
 		bytes_reserve = 0;
 	}
+	/*
+	 * Whatever isn't released stays with the GFB
+	 */
+	m_vram_tag_bytes[kVRAMTagGFB] = s;
+	m_vram_tag_peak[kVRAMTagGFB] = s;
 	if (HaveFrontBuffer()) {
 		rc = m_allocator->Release(0, s);
 		if (rc != kIOReturnSuccess) {
@@ -465,7 +502,8 @@ IOReturn CLASS::setupAllocator()
 				  __FUNCTION__, 0, FMT_LU(s), rc);
 			if (!bytes_reserve)			// We already got some memory, so it's ok
 				rc = kIOReturnSuccess;
-		}
+		} else
+			m_vram_tag_bytes[kVRAMTagGFB] = 0U;
 	}
 exit:
 	if (rc != kIOReturnSuccess) {
@@ -475,6 +513,92 @@ exit:
 	return rc;
 }
 
+HIDDEN
+void CLASS::accountVRAM(VRAMTag tag, size_t old_bytes, size_t new_bytes)
+{
+	size_t* live = &m_vram_tag_bytes[tag];
+
+	*live += new_bytes - old_bytes;
+	if (*live > m_vram_tag_peak[tag])
+		m_vram_tag_peak[tag] = *live;
+}
+
+HIDDEN
+void CLASS::publishVRAMStats()
+{
+	static char const* const tag_names[kVRAMNumTags] = { "Scratch", "SurfaceBacking", "VertexArray", "GFB" };
+	CEsvga2AllocatorStats stats;
+	size_t tag_bytes[kVRAMNumTags], tag_peak[kVRAMNumTags];
+	uint32_t tag_fallbacks[kVRAMNumTags];
+	OSDictionary *dict, *owner;
+	OSArray *free_blocks, *live_blocks;
+	OSNumber* n;
+	int i;
+
+	if (!m_allocator || !m_iolock)
+		return;
+	lockAccel();
+	m_allocator->Statistics(&stats);
+	memcpy(tag_bytes, m_vram_tag_bytes, sizeof tag_bytes);
+	memcpy(tag_peak, m_vram_tag_peak, sizeof tag_peak);
+	memcpy(tag_fallbacks, m_vram_tag_fallbacks, sizeof tag_fallbacks);
+	unlockAccel();
+	dict = OSDictionary::withCapacity(7U + kVRAMNumTags);
+	free_blocks = OSArray::withCapacity(ALLOCATOR_NUM_SIZES);
+	live_blocks = OSArray::withCapacity(ALLOCATOR_NUM_SIZES);
+	if (!dict || !free_blocks || !live_blocks)
+		goto exit;
+#define SET_NUMBER(d, key, value) \
+	do { \
+		n = OSNumber::withNumber(static_cast<unsigned long long>(value), 64U); \
+		if (n) { \
+			d->setObject(key, n); \
+			n->release(); \
+		} \
+	} while (false)
+	SET_NUMBER(dict, "PoolBytes", stats.poolBytes);
+	SET_NUMBER(dict, "FreeBytes", stats.freeBytes);
+	SET_NUMBER(dict, "PeakBytes", stats.peakBytes);
+	SET_NUMBER(dict, "LargestFreeBlock", stats.largestFree);
+	SET_NUMBER(dict, "Failures", stats.failures);
+	/*
+	 * Size classes go up by powers of two from PAGE_SIZE
+	 */
+	for (i = 0; i < ALLOCATOR_NUM_SIZES; ++i) {
+		n = OSNumber::withNumber(static_cast<unsigned long long>(stats.freeBlocks[i]), 32U);
+		if (n) {
+			free_blocks->setObject(n);
+			n->release();
+		}
+		n = OSNumber::withNumber(static_cast<unsigned long long>(stats.liveBlocks[i]), 32U);
+		if (n) {
+			live_blocks->setObject(n);
+			n->release();
+		}
+	}
+	dict->setObject("FreeBlocks", free_blocks);
+	dict->setObject("LiveBlocks", live_blocks);
+	for (i = 0; i < kVRAMNumTags; ++i) {
+		owner = OSDictionary::withCapacity(3U);
+		if (!owner)
+			continue;
+		SET_NUMBER(owner, "Bytes", tag_bytes[i]);
+		SET_NUMBER(owner, "PeakBytes", tag_peak[i]);
+		SET_NUMBER(owner, "GMRFallbacks", tag_fallbacks[i]);
+		dict->setObject(tag_names[i], owner);
+		owner->release();
+	}
+#undef SET_NUMBER
+	setProperty("CECLSVGAVRAMStats", dict);
+exit:
+	if (live_blocks)
+		live_blocks->release();
+	if (free_blocks)
+		free_blocks->release();
+	if (dict)
+		dict->release();
+}
+
 #ifdef FB_NOTIFIER
 HIDDEN
 IOReturn CLASS::fbNotificationHandler(void* ref,
@@ -515,6 +639,8 @@ bool CLASS::init(OSDictionary* dictionary)
 	m_log_level_ac = LOGGING_LEVEL;
 	m_log_level_ga = -1;
 	m_log_level_gld = -1;
+	m_texture_budget = static_cast<size_t>(TEXTURE_HOST_BUDGET_MB) << 20;
+	m_gl_command_buffers = GL_COMMAND_BUFFERS;
 	m_master_surface_id = SVGA_ID_INVALID;
 	m_blitbug_result = kIOReturnNotFound;
 	m_present_tracker.init();
@@ -655,6 +781,17 @@ void CLASS::stop(IOService* provider)
 	super::stop(provider);
 }
 
+/*
+ * Note: VRAM statistics are refreshed on demand, so
+ *   ioreg always sees current numbers without the
+ *   allocator paying for it on every call.
+ */
+bool CLASS::serializeProperties(OSSerialize* s) const
+{
+	const_cast<CLASS*>(this)->publishVRAMStats();
+	return super::serializeProperties(s);
+}
+
 IOReturn CLASS::newUserClient(task_t owningTask,
 							  void* securityID,
 							  UInt32 type,
@@ -775,6 +912,30 @@ IOReturn CLASS::SyncToFence(uint32_t fence)
 	return kIOReturnSuccess;
 }
 
+HIDDEN
+bool CLASS::HasFencePassed(uint32_t fence) const
+{
+	if (!m_svga)
+		return true;
+	return m_svga->HasFencePassed(fence);
+}
+
+/*
+ * Returns 0 if no fence could be inserted
+ */
+HIDDEN
+uint32_t CLASS::InsertFence()
+{
+	uint32_t fence;
+
+	if (!m_framebuffer)
+		return 0U;
+	m_framebuffer->lockDevice();
+	fence = m_svga->InsertFence();
+	m_framebuffer->unlockDevice();
+	return fence;
+}
+
 #pragma mark -
 #pragma mark SVGA FIFO Acceleration Methods for 2D Context
 #pragma mark -
@@ -862,7 +1023,7 @@ IOReturn CLASS::RectFillScreen(uint32_t framebufferIndex,
 	set_region(rgn, rects, numRects);
 
 	s2 = rgn->bounds.w * rgn->bounds.h * sizeof(uint32_t);
-	p = VRAMMalloc(s2);
+	p = VRAMMalloc(s2, kVRAMTagScratch);
 	if (!p) {
 		IOFree(rgn, s1);
 		return kIOReturnNoMemory;
@@ -1166,6 +1327,32 @@ exit:
 	return kIOReturnSuccess;
 }
 
+/*
+ * Copies between any face and mipmap of two surfaces
+ */
+HIDDEN
+IOReturn CLASS::surfaceCopy(SVGA3dSurfaceImageId const* srcImage,
+							SVGA3dSurfaceImageId const* dstImage,
+							SVGA3dCopyBox const* copyBoxes,
+							size_t numCopyBoxes)
+{
+	SVGA3dCopyBox* boxes;
+
+	if (!srcImage || !dstImage || !copyBoxes)
+		return kIOReturnBadArgument;
+	if (!bHaveSVGA3D)
+		return kIOReturnNoDevice;
+	if (!numCopyBoxes)
+		return kIOReturnSuccess;
+	m_framebuffer->lockDevice();
+	if (svga3d.BeginSurfaceCopy(srcImage, dstImage, &boxes, numCopyBoxes)) {
+		memcpy(boxes, copyBoxes, numCopyBoxes * sizeof *boxes);
+		m_svga->FIFOCommitAll();
+	}
+	m_framebuffer->unlockDevice();
+	return kIOReturnSuccess;
+}
+
 HIDDEN
 IOReturn CLASS::surfaceStretch(uint32_t src_sid,
 							   uint32_t dst_sid,
@@ -1198,12 +1385,40 @@ IOReturn CLASS::surfaceStretch(uint32_t src_sid,
 	dstBox.w = static_cast<uint32_t>(d_rect->w);
 	dstBox.h = static_cast<uint32_t>(d_rect->h);
 	dstBox.d = 1;
+	return surfaceStretch(&srcImage, &dstImage, mode, &srcBox, &dstBox);
+}
+
+HIDDEN
+IOReturn CLASS::surfaceStretch(SVGA3dSurfaceImageId const* srcImage,
+							   SVGA3dSurfaceImageId const* dstImage,
+							   SVGA3dStretchBltMode mode,
+							   SVGA3dBox const* srcBox,
+							   SVGA3dBox const* dstBox)
+{
+	if (!srcImage || !dstImage || !srcBox || !dstBox)
+		return kIOReturnBadArgument;
+	if (!bHaveSVGA3D)
+		return kIOReturnNoDevice;
 	m_framebuffer->lockDevice();
-	svga3d.SurfaceStretchBlt(&srcImage, &dstImage, &srcBox, &dstBox, mode);
+	svga3d.SurfaceStretchBlt(srcImage, dstImage, srcBox, dstBox, mode);
 	m_framebuffer->unlockDevice();
 	return kIOReturnSuccess;
 }
 
+HIDDEN
+IOReturn CLASS::generateMipmaps(uint32_t sid,
+								SVGA3dTextureFilter filter)
+{
+	bool rc;
+
+	if (!bHaveSVGA3D)
+		return kIOReturnNoDevice;
+	m_framebuffer->lockDevice();
+	rc = svga3d.GenerateMipmaps(sid, filter);
+	m_framebuffer->unlockDevice();
+	return rc ? kIOReturnSuccess : kIOReturnNoMemory;
+}
+
 HIDDEN
 IOReturn CLASS::surfacePresentAutoSync(uint32_t sid,
 									   void /* IOAccelDeviceRegion */ const* region,
@@ -1416,12 +1631,27 @@ IOReturn CLASS::surfaceDMA3DEx(SVGA3dSurfaceImageId const* hostImage,
 							   SVGA3dCopyBox const* copyBox,
 							   ExtraInfoEx const* extra,
 							   uint32_t* fence)
+{
+	return surfaceDMA3DEx(hostImage, transfer, copyBox, 1U, extra, fence);
+}
+
+/*
+ * All boxes share the guest image, with srcx/srcy/srcz
+ *   relative to mem_offset_in_gmr
+ */
+HIDDEN
+IOReturn CLASS::surfaceDMA3DEx(SVGA3dSurfaceImageId const* hostImage,
+							   SVGA3dTransferType transfer,
+							   SVGA3dCopyBox const* copyBoxes,
+							   size_t numCopyBoxes,
+							   ExtraInfoEx const* extra,
+							   uint32_t* fence)
 {
 	bool rc;
-	SVGA3dCopyBox* copyBoxes;
+	SVGA3dCopyBox* boxes;
 	SVGA3dGuestImage guestImage;
 
-	if (!extra || !copyBox)
+	if (!extra || !copyBoxes || !numCopyBoxes)
 		return kIOReturnBadArgument;
 	if (!bHaveSVGA3D)
 		return kIOReturnNoDevice;
@@ -1432,13 +1662,13 @@ IOReturn CLASS::surfaceDMA3DEx(SVGA3dSurfaceImageId const* hostImage,
 	rc = svga3d.BeginSurfaceDMAwithSuffix(&guestImage,
 										  hostImage,
 										  transfer,
-										  &copyBoxes,
-										  1U,
+										  &boxes,
+										  numCopyBoxes,
 										  static_cast<uint32_t>(extra->mem_limit),
 										  *reinterpret_cast<SVGA3dSurfaceDMAFlags const*>(&extra->suffix_flags));
 	if (!rc)
 		goto exit;
-	memcpy(&copyBoxes[0], copyBox, sizeof *copyBox);
+	memcpy(&boxes[0], copyBoxes, numCopyBoxes * sizeof *copyBoxes);
 	m_svga->FIFOCommitAll();
 	if (fence)
 		*fence = m_svga->InsertFence();
@@ -2075,15 +2305,20 @@ void CLASS::FreeGMRID(uint32_t gmrId)
 #pragma mark -
 
 HIDDEN
-void* CLASS::VRAMMalloc(size_t bytes)
+void* CLASS::VRAMMalloc(size_t bytes, VRAMTag tag)
 {
 	IOReturn rc;
 	void* p = 0;
+	size_t new_bytes = 0U;
 
 	if (!m_allocator)
 		return 0;
 	lockAccel();
 	rc = m_allocator->Malloc(bytes, &p);
+	if (rc == kIOReturnSuccess) {
+		m_allocator->AllocSize(p, &new_bytes);
+		accountVRAM(tag, 0U, new_bytes);
+	}
 	unlockAccel();
 	if (rc != kIOReturnSuccess)
 		ACLog(1, "%s(%lu) failed\n", __FUNCTION__, bytes);
@@ -2091,15 +2326,23 @@ void* CLASS::VRAMMalloc(size_t bytes)
 }
 
 HIDDEN
-void* CLASS::VRAMRealloc(void* ptr, size_t bytes)
+void* CLASS::VRAMRealloc(void* ptr, size_t bytes, VRAMTag tag)
 {
 	IOReturn rc;
 	void* newp = 0;
+	size_t old_bytes = 0U, new_bytes = 0U;
 
 	if (!m_allocator)
 		return 0;
 	lockAccel();
+	if (ptr)
+		m_allocator->AllocSize(ptr, &old_bytes);
 	rc = m_allocator->Realloc(ptr, bytes, &newp);
+	if (rc == kIOReturnSuccess) {
+		if (newp)
+			m_allocator->AllocSize(newp, &new_bytes);
+		accountVRAM(tag, old_bytes, new_bytes);
+	}
 	unlockAccel();
 	if (rc != kIOReturnSuccess)
 		ACLog(1, "%s(%p, %lu) failed\n", __FUNCTION__, ptr, bytes);
@@ -2107,19 +2350,36 @@ void* CLASS::VRAMRealloc(void* ptr, size_t bytes)
 }
 
 HIDDEN
-void CLASS::VRAMFree(void* ptr)
+void CLASS::VRAMFree(void* ptr, VRAMTag tag)
 {
 	IOReturn rc;
+	size_t old_bytes = 0U;
 
 	if (!m_allocator)
 		return;
 	lockAccel();
+	if (ptr)
+		m_allocator->AllocSize(ptr, &old_bytes);
 	rc = m_allocator->Free(ptr);
+	if (rc == kIOReturnSuccess)
+		accountVRAM(tag, old_bytes, 0U);
 	unlockAccel();
 	if (rc != kIOReturnSuccess)
 		ACLog(1, "%s(%p) failed\n", __FUNCTION__, ptr);
 }
 
+/*
+ * Called by clients that had to fall back on a GMR
+ *   because VRAM was exhausted.
+ */
+HIDDEN
+void CLASS::VRAMFallbackToGMR(VRAMTag tag)
+{
+	lockAccel();
+	++m_vram_tag_fallbacks[tag];
+	unlockAccel();
+}
+
 HIDDEN
 IOMemoryMap* CLASS::mapVRAMRangeForTask(task_t task, vm_offset_t offset_in_vram, vm_size_t size)
 {
@@ -2136,32 +2396,96 @@ IOMemoryMap* CLASS::mapVRAMRangeForTask(task_t task, vm_offset_t offset_in_vram,
 #define getPhysicalSegment(x, y, z) getPhysicalSegment64(x, y)
 #endif
 
+/*
+ * Descriptor pages are only read by the host when the GMR
+ *   is defined, so a single pooled set is reused while not busy.
+ */
+HIDDEN
+IOBufferMemoryDescriptor* CLASS::getGMRDescriptorPages(size_t num_pages)
+{
+	IOBufferMemoryDescriptor* helper;
+	size_t const max_bits = PAGE_SHIFT + 8U * sizeof(uint32_t);
+	size_t alloc_pages = num_pages;
+	bool pooled = OSCompareAndSwap(0U, 1U, &m_gmr_desc_busy);
+
+	if (pooled) {
+		if (m_gmr_desc_pool && m_gmr_desc_pool_pages >= num_pages)
+			return m_gmr_desc_pool;
+		if (m_gmr_desc_pool) {
+			m_gmr_desc_pool->complete();
+			m_gmr_desc_pool->release();
+			m_gmr_desc_pool = 0;
+			m_gmr_desc_pool_pages = 0U;
+		}
+		if (alloc_pages < GMR_DESC_POOL_PAGES)
+			alloc_pages = GMR_DESC_POOL_PAGES;
+	}
+	helper = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
+															  kIODirectionInOut,
+															  alloc_pages << PAGE_SHIFT,
+															  ((1ULL << max_bits) - 1ULL) & -PAGE_SIZE);
+	if (helper && helper->prepare() != kIOReturnSuccess) {
+		helper->release();
+		helper = 0;
+	}
+	if (pooled) {
+		if (helper) {
+			m_gmr_desc_pool = helper;
+			m_gmr_desc_pool_pages = alloc_pages;
+		} else
+			OSCompareAndSwap(1U, 0U, &m_gmr_desc_busy);
+	}
+	return helper;
+}
+
+HIDDEN
+void CLASS::putGMRDescriptorPages(IOBufferMemoryDescriptor* helper)
+{
+	if (helper == m_gmr_desc_pool) {
+		OSCompareAndSwap(1U, 0U, &m_gmr_desc_busy);
+		return;
+	}
+	helper->complete();
+	helper->release();
+}
+
 HIDDEN
 IOReturn CLASS::createGMR(uint32_t gmrId, IOMemoryDescriptor* md)
 {
 	IOBufferMemoryDescriptor* helper;
-	addr64_t phys_addr;
+	addr64_t phys_addr, next_phys_addr;
 	IOByteCount offset, length = 0U, helper_length = 0U;
 	size_t const dpp = (PAGE_SIZE / sizeof(SVGAGuestMemDescriptor)) - 1U;
 	size_t const max_bits = PAGE_SHIFT + 8U * sizeof(uint32_t);
 	size_t num_physical_ranges, num_pages, next_page, in_page_count;
 	IOVirtualAddress helper_base;
-	SVGAGuestMemDescriptor* helper_ptr;
+	SVGAGuestMemDescriptor *helper_ptr, *last_ptr;
 	uint32_t helper_base_ppn, helper_ppn;
-	IOReturn rc;
 
 	if (!md)
 		return kIOReturnBadArgument;
 	if (!m_framebuffer)
 		return kIOReturnNoDevice;
+	/*
+	 * GMR2 takes a flat PPN list in the FIFO, so no descriptor pages are needed
+	 */
+	if (m_svga->HasCapability(SVGA_CAP_GMR2))
+		return createGMR2(gmrId, md);
 	if (!m_svga->HasCapability(SVGA_CAP_GMR))
 		return kIOReturnUnsupported;
+	/*
+	 * Note: physically contiguous segments that meet
+	 *   on a page boundary share a single descriptor.
+	 */
 	num_physical_ranges = 0U;
 	offset = 0U;
+	next_phys_addr = 0U;
 	while ((phys_addr = md->getPhysicalSegment(offset, &length, 0U))) {
 		if (phys_addr >> max_bits)
 			return kIOReturnUnsupported;
-		++num_physical_ranges;
+		if (phys_addr != next_phys_addr || (phys_addr & (PAGE_SIZE - 1U)))
+			++num_physical_ranges;
+		next_phys_addr = phys_addr + length;
 		offset += length;
 	}
 	if (!num_physical_ranges)
@@ -2169,17 +2493,9 @@ IOReturn CLASS::createGMR(uint32_t gmrId, IOMemoryDescriptor* md)
 	num_pages = (num_physical_ranges + (dpp - 1U)) / dpp;
 	if (num_physical_ranges + num_pages > m_svga->getMaxGMRDescriptorLength())
 		return kIOReturnNoResources;
-	helper = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
-															  kIODirectionInOut,
-															  num_pages << PAGE_SHIFT,
-															  ((1ULL << max_bits) - 1ULL) & -PAGE_SIZE);
+	helper = getGMRDescriptorPages(num_pages);
 	if (!helper)
 		return kIOReturnNoResources;
-	rc = helper->prepare();
-	if (rc != kIOReturnSuccess) {
-		helper->release();
-		return rc;
-	}
 	helper_base = reinterpret_cast<IOVirtualAddress>(helper->getBytesNoCopy());
 	helper_ptr = reinterpret_cast<SVGAGuestMemDescriptor*>(helper_base);
 	bzero(helper_ptr, num_pages << PAGE_SHIFT);
@@ -2190,12 +2506,23 @@ IOReturn CLASS::createGMR(uint32_t gmrId, IOMemoryDescriptor* md)
 	offset = 0U;
 	next_page = 1U;
 	in_page_count = dpp;
+	next_phys_addr = 0U;
+	last_ptr = 0;
 	while ((phys_addr = md->getPhysicalSegment(offset, &length, 0U))) {
 		offset += length;
+		if (last_ptr &&
+			phys_addr == next_phys_addr &&
+			!(phys_addr & (PAGE_SIZE - 1U))) {
+			next_phys_addr = phys_addr + length;
+			last_ptr->numPages += static_cast<uint32_t>((length + (PAGE_SIZE - 1U)) >> PAGE_SHIFT);
+			continue;
+		}
+		next_phys_addr = phys_addr + length;
 		length += static_cast<IOByteCount>(phys_addr & (PAGE_SIZE - 1U));
 		length = (length + (PAGE_SIZE - 1U)) & -PAGE_SIZE;
 		helper_ptr->ppn = static_cast<uint32_t>(phys_addr >> PAGE_SHIFT);
 		helper_ptr->numPages = static_cast<uint32_t>(length >> PAGE_SHIFT);
+		last_ptr = helper_ptr;
 		++helper_ptr;
 		--in_page_count;
 		if (in_page_count)
@@ -2216,8 +2543,7 @@ IOReturn CLASS::createGMR(uint32_t gmrId, IOMemoryDescriptor* md)
 	m_framebuffer->lockDevice();
 	m_svga->defineGMR(gmrId, helper_base_ppn);
 	m_framebuffer->unlockDevice();
-	helper->complete();
-	helper->release();
+	putGMRDescriptorPages(helper);
 	return kIOReturnSuccess;
 }
 
@@ -2226,9 +2552,10 @@ IOReturn CLASS::createGMR2(uint32_t gmrId, IOMemoryDescriptor* md)
 {
 	addr64_t phys_addr;
 	IOByteCount offset, length = 0U;
-	size_t const max_bits = PAGE_SHIFT + 8U * sizeof(uint32_t);
-	size_t num_pages, list_size;
-	uint32_t *ppn_list, *list_iter;
+	size_t num_pages;
+	uint64_t* chunk;
+	uint32_t done, count;
+	bool ok = true;
 
 	if (!md)
 		return kIOReturnBadArgument;
@@ -2236,7 +2563,17 @@ IOReturn CLASS::createGMR2(uint32_t gmrId, IOMemoryDescriptor* md)
 		return kIOReturnNoDevice;
 	if (!m_svga->HasCapability(SVGA_CAP_GMR2))
 		return kIOReturnUnsupported;
-	num_pages = (md->getLength() + PAGE_SIZE - 1U) >> PAGE_SHIFT;		// Note: Assumes start offset is zero
+	/*
+	 * Count the pages actually spanned, in case
+	 *   the descriptor doesn't start on a page boundary.
+	 */
+	num_pages = 0U;
+	offset = 0U;
+	while ((phys_addr = md->getPhysicalSegment(offset, &length, 0U))) {
+		offset += length;
+		length += static_cast<IOByteCount>(phys_addr & (PAGE_SIZE - 1U));
+		num_pages += (length + (PAGE_SIZE - 1U)) >> PAGE_SHIFT;
+	}
 	if (!num_pages)
 		return kIOReturnBadArgument;
 	/*
@@ -2246,36 +2583,50 @@ IOReturn CLASS::createGMR2(uint32_t gmrId, IOMemoryDescriptor* md)
 	 */
 	if (num_pages > m_svga->getMaxGMRPages())
 		return kIOReturnUnsupported;
-	list_size = num_pages * sizeof *ppn_list;
-	ppn_list = static_cast<uint32_t*>(IOMalloc(list_size));
-	if (!ppn_list)
+	/*
+	 * PPNs are generated a chunk at a time and sent with
+	 *   per-offset remaps, so memory used here doesn't
+	 *   grow with the size of the GMR.
+	 * Note: pages above the 32-bit PPN range are
+	 *   sent as PPN64 by remapGMR2PPNs.
+	 */
+	chunk = static_cast<uint64_t*>(IOMalloc(GMR2_REMAP_CHUNK_PAGES * sizeof *chunk));
+	if (!chunk)
 		return kIOReturnNoMemory;
+	m_framebuffer->lockDevice();
+	if (!m_svga->defineGMR2(gmrId, static_cast<uint32_t>(num_pages))) {
+		m_framebuffer->unlockDevice();
+		IOFree(chunk, GMR2_REMAP_CHUNK_PAGES * sizeof *chunk);
+		return kIOReturnDeviceError;
+	}
+	m_framebuffer->unlockDevice();
 	offset = 0U;
-	list_iter = ppn_list;
-	while ((phys_addr = md->getPhysicalSegment(offset, &length, 0U))) {
-		if (phys_addr >> max_bits) {
-			IOFree(ppn_list, list_size);
-			return kIOReturnUnsupported;	// Note: can support this by using PPN64
-		}
+	done = 0U;
+	count = 0U;
+	while (ok && (phys_addr = md->getPhysicalSegment(offset, &length, 0U))) {
 		offset += length;
 		length += static_cast<IOByteCount>(phys_addr & (PAGE_SIZE - 1U));
 		length = (length + (PAGE_SIZE - 1U)) >> PAGE_SHIFT;
 		phys_addr >>= PAGE_SHIFT;
-		for (; length; --length) {
-			*list_iter++ = static_cast<uint32_t>(phys_addr);
-			++phys_addr;
+		for (; ok && length; --length) {
+			chunk[count++] = phys_addr++;
+			if (count != GMR2_REMAP_CHUNK_PAGES)
+				continue;
+			m_framebuffer->lockDevice();
+			ok = m_svga->remapGMR2PPNs(gmrId, done, count, chunk);
+			m_framebuffer->unlockDevice();
+			done += count;
+			count = 0U;
 		}
 	}
 	m_framebuffer->lockDevice();
-	if (!m_svga->defineGMR2(gmrId, static_cast<uint32_t>(num_pages))) {
-		m_framebuffer->unlockDevice();
-		IOFree(ppn_list, list_size);
-		return kIOReturnDeviceError;
-	}
-	m_svga->remapGMR2(gmrId, 0U, 0U, static_cast<uint32_t>(num_pages), ppn_list, list_size);
+	if (ok && count)
+		ok = m_svga->remapGMR2PPNs(gmrId, done, count, chunk);
+	if (!ok)
+		m_svga->defineGMR2(gmrId, 0U);
 	m_framebuffer->unlockDevice();
-	IOFree(ppn_list, list_size);
-	return kIOReturnSuccess;
+	IOFree(chunk, GMR2_REMAP_CHUNK_PAGES * sizeof *chunk);
+	return ok ? kIOReturnSuccess : kIOReturnDeviceError;
 }
 
 #if __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ < 1060
@@ -2287,6 +2638,8 @@ IOReturn CLASS::destroyGMR(uint32_t gmrId)
 {
 	if (!m_framebuffer)
 		return kIOReturnNoDevice;
+	if (m_svga->HasCapability(SVGA_CAP_GMR2))
+		return destroyGMR2(gmrId);
 	if (!m_svga->HasCapability(SVGA_CAP_GMR))
 		return kIOReturnUnsupported;
 	m_framebuffer->lockDevice();
@@ -2306,3 +2659,385 @@ IOReturn CLASS::destroyGMR2(uint32_t gmrId)
 	m_framebuffer->unlockDevice();
 	return kIOReturnSuccess;
 }
+
+#pragma mark -
+#pragma mark GMR Cache
+#pragma mark -
+
+#if __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ < 1060
+#define getPhysicalSegment(x, y, z) getPhysicalSegment64(x, y)
+#endif
+
+/*
+ * FNV-1a over the physical segments
+ */
+HIDDEN
+uint64_t CLASS::hashPhysicalPages(IOMemoryDescriptor* md)
+{
+	addr64_t phys_addr;
+	IOByteCount offset = 0U, length = 0U;
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	while ((phys_addr = md->getPhysicalSegment(offset, &length, 0U))) {
+		h = (h ^ phys_addr) * 0x100000001B3ULL;
+		h = (h ^ length) * 0x100000001B3ULL;
+		offset += length;
+	}
+	return h;
+}
+
+HIDDEN
+bool CLASS::samePhysicalPages(IOMemoryDescriptor* md1, IOMemoryDescriptor* md2, IOByteCount length)
+{
+	addr64_t phys_addr1, phys_addr2;
+	IOByteCount offset = 0U, length1 = 0U, length2 = 0U;
+
+	while (offset < length) {
+		phys_addr1 = md1->getPhysicalSegment(offset, &length1, 0U);
+		phys_addr2 = md2->getPhysicalSegment(offset, &length2, 0U);
+		if (!phys_addr1 || phys_addr1 != phys_addr2)
+			return false;
+		offset += (length1 < length2 ? length1 : length2);
+	}
+	return true;
+}
+
+/*
+ * Evicts the least recently used idle entry,
+ *   waiting for the last fence that referenced it.
+ */
+HIDDEN
+bool CLASS::evictGMRCacheEntry()
+{
+	GMRCacheEntry victim, *e, *lru = 0;
+	size_t i;
+
+	lockAccel();
+	for (i = 0U; i != GMR_CACHE_SIZE; ++i) {
+		e = &m_gmr_cache[i];
+		if (!e->md || e->refcount)
+			continue;
+		if (!lru || static_cast<int>(e->lru_stamp - lru->lru_stamp) < 0)
+			lru = e;
+	}
+	if (!lru) {
+		unlockAccel();
+		return false;
+	}
+	victim = *lru;
+	m_gmr_cache_bytes -= lru->length;
+	bzero(lru, sizeof *lru);
+	unlockAccel();
+	if (victim.fence)
+		SyncToFence(victim.fence);
+	destroyGMR(victim.gmr_id);
+	victim.md->complete();
+	victim.md->release();
+	FreeGMRID(victim.gmr_id);
+	return true;
+}
+
+/*
+ * Note: md must be prepared by the caller
+ */
+HIDDEN
+IOReturn CLASS::acquireGMR(IOMemoryDescriptor* md, uint32_t* gmrId)
+{
+	GMRCacheEntry *e, *slot;
+	IOByteCount length;
+	uint64_t page_hash;
+	uint32_t gmr_id;
+	size_t i, j;
+	IOReturn rc;
+
+	if (!md || !gmrId)
+		return kIOReturnBadArgument;
+	length = md->getLength();
+	page_hash = hashPhysicalPages(md);
+	lockAccel();
+	for (i = 0U; i != GMR_CACHE_SIZE; ++i) {
+		e = &m_gmr_cache[i];
+		if (!e->md ||
+			e->length != length ||
+			e->page_hash != page_hash)
+			continue;
+		if (e->md != md && !samePhysicalPages(e->md, md, length))
+			continue;
+		++e->refcount;
+		e->lru_stamp = ++m_gmr_cache_clock;
+		*gmrId = e->gmr_id;
+		unlockAccel();
+		return kIOReturnSuccess;
+	}
+	unlockAccel();
+	gmr_id = AllocGMRID();
+	if (static_cast<int>(gmr_id) < 0 && evictGMRCacheEntry())
+		gmr_id = AllocGMRID();
+	if (static_cast<int>(gmr_id) < 0)
+		return kIOReturnNoResources;
+	rc = createGMR(gmr_id, md);
+	if (rc != kIOReturnSuccess) {
+		FreeGMRID(gmr_id);
+		return rc;
+	}
+	*gmrId = gmr_id;
+	/*
+	 * If the GMR can't be cached, releaseGMR destroys it.
+	 *   Only buffers the kernel allocated are cached, as the cache
+	 *   keeps them wired.  A descriptor of client memory (from
+	 *   withAddressRange) would keep pages the client may since
+	 *   have freed, or those of an exited task.
+	 */
+	if (length > GMR_CACHE_MAX_BYTES ||
+		!OSDynamicCast(IOBufferMemoryDescriptor, md) ||
+		md->prepare() != kIOReturnSuccess)
+		return kIOReturnSuccess;
+	md->retain();
+	for (j = 0U; j != GMR_CACHE_SIZE; ++j) {
+		lockAccel();
+		slot = 0;
+		if (m_gmr_cache_bytes + length <= GMR_CACHE_MAX_BYTES)
+			for (i = 0U; i != GMR_CACHE_SIZE; ++i)
+				if (!m_gmr_cache[i].md) {
+					slot = &m_gmr_cache[i];
+					break;
+				}
+		if (slot) {
+			slot->md = md;
+			slot->length = length;
+			slot->page_hash = page_hash;
+			slot->gmr_id = gmr_id;
+			slot->fence = 0U;
+			slot->refcount = 1U;
+			slot->lru_stamp = ++m_gmr_cache_clock;
+			m_gmr_cache_bytes += length;
+			unlockAccel();
+			return kIOReturnSuccess;
+		}
+		unlockAccel();
+		if (!evictGMRCacheEntry())
+			break;
+	}
+	md->complete();
+	md->release();
+	return kIOReturnSuccess;
+}
+
+HIDDEN
+void CLASS::releaseGMR(uint32_t gmrId, uint32_t fence)
+{
+	GMRCacheEntry* e;
+	size_t i;
+
+	lockAccel();
+	for (i = 0U; i != GMR_CACHE_SIZE; ++i) {
+		e = &m_gmr_cache[i];
+		if (!e->md || e->gmr_id != gmrId)
+			continue;
+		if (fence)
+			e->fence = fence;
+		if (e->refcount)
+			--e->refcount;
+		unlockAccel();
+		return;
+	}
+	unlockAccel();
+	/*
+	 * Not cached
+	 */
+	if (fence)
+		SyncToFence(fence);
+	destroyGMR(gmrId);
+	FreeGMRID(gmrId);
+}
+
+HIDDEN
+void CLASS::flushGMRCache()
+{
+	if (!m_iolock)
+		return;
+	while (evictGMRCacheEntry());
+}
+
+#if __ENVIRONMENT_MAC_OS_X_VERSION_MIN_REQUIRED__ < 1060
+#undef getPhysicalSegment
+#endif
+
+#pragma mark -
+#pragma mark Shader Program Cache
+#pragma mark -
+
+/*
+ * Returns the slot holding the program, or SHADER_PROGRAM_CACHE_SIZE
+ *   Note: caller holds the accel lock
+ */
+HIDDEN
+size_t CLASS::findShaderProgram(uint32_t const* source, uint32_t num_dwords, uint64_t hash) const
+{
+	ShaderProgram* p;
+	size_t i;
+
+	for (i = hash & (SHADER_PROGRAM_CACHE_SIZE - 1U);
+		 (p = m_shader_programs[i]) != 0;
+		 i = (i + 1U) & (SHADER_PROGRAM_CACHE_SIZE - 1U))
+		if (p->hash == hash &&
+			p->num_dwords == num_dwords &&
+			!memcmp(p->source, source, num_dwords * sizeof(uint32_t)))
+			return i;
+	return SHADER_PROGRAM_CACHE_SIZE;
+}
+
+HIDDEN
+void CLASS::freeShaderProgram(ShaderProgram* program)
+{
+	if (program->source)
+		IOFree(program->source, program->num_dwords * sizeof(uint32_t));
+	if (program->bytecode_buf)
+		IOFree(program->bytecode_buf, program->bytecode_len);
+	IOFree(program, sizeof *program);
+}
+
+/*
+ * Removes by shifting back the rest of the probe sequence,
+ *   so lookups never need tombstones.
+ *   Note: caller holds the accel lock
+ */
+HIDDEN
+void CLASS::removeShaderProgram(size_t slot)
+{
+	size_t i, home;
+	uint32_t const mask = SHADER_PROGRAM_CACHE_SIZE - 1U;
+
+	freeShaderProgram(m_shader_programs[slot]);
+	--m_shader_program_count;
+	for (i = (slot + 1U) & mask; m_shader_programs[i]; i = (i + 1U) & mask) {
+		home = m_shader_programs[i]->hash & mask;
+		if (((i - home) & mask) < ((i - slot) & mask))
+			continue;
+		m_shader_programs[slot] = m_shader_programs[i];
+		slot = i;
+	}
+	m_shader_programs[slot] = 0;
+}
+
+/*
+ * Evicts the least recently used unreferenced program
+ *   Note: caller holds the accel lock
+ */
+HIDDEN
+bool CLASS::evictShaderProgram()
+{
+	ShaderProgram* p;
+	size_t i, lru = SHADER_PROGRAM_CACHE_SIZE;
+
+	for (i = 0U; i != SHADER_PROGRAM_CACHE_SIZE; ++i) {
+		p = m_shader_programs[i];
+		if (!p || p->refcount)
+			continue;
+		if (lru == SHADER_PROGRAM_CACHE_SIZE ||
+			static_cast<int>(p->lru_stamp - m_shader_programs[lru]->lru_stamp) < 0)
+			lru = i;
+	}
+	if (lru == SHADER_PROGRAM_CACHE_SIZE)
+		return false;
+	removeShaderProgram(lru);
+	return true;
+}
+
+HIDDEN
+void CLASS::flushShaderPrograms()
+{
+	size_t i;
+
+	for (i = 0U; i != SHADER_PROGRAM_CACHE_SIZE; ++i)
+		if (m_shader_programs[i]) {
+			freeShaderProgram(m_shader_programs[i]);
+			m_shader_programs[i] = 0;
+		}
+	m_shader_program_count = 0U;
+}
+
+HIDDEN
+CLASS::ShaderProgram* CLASS::acquireShaderProgram(uint32_t const* source, uint32_t num_dwords, uint64_t hash)
+{
+	ShaderProgram* p = 0;
+	size_t i;
+
+	if (!source || !num_dwords)
+		return 0;
+	lockAccel();
+	i = findShaderProgram(source, num_dwords, hash);
+	if (i != SHADER_PROGRAM_CACHE_SIZE) {
+		p = m_shader_programs[i];
+		++p->refcount;
+		p->lru_stamp = ++m_shader_program_clock;
+	}
+	unlockAccel();
+	return p;
+}
+
+/*
+ * Adds a program described by proto, which must not be cached yet.
+ *   Takes ownership of proto->bytecode_buf.  If another context added
+ *   the same program meanwhile, returns that one instead.
+ */
+HIDDEN
+CLASS::ShaderProgram* CLASS::addShaderProgram(ShaderProgram const* proto)
+{
+	ShaderProgram *p, *q;
+	uint32_t* source;
+	size_t i;
+
+	p = static_cast<ShaderProgram*>(IOMalloc(sizeof *p));
+	if (!p)
+		goto fail;
+	*p = *proto;
+	source = static_cast<uint32_t*>(IOMalloc(proto->num_dwords * sizeof(uint32_t)));
+	p->source = source;
+	if (!source)
+		goto fail_free;
+	memcpy(source, proto->source, proto->num_dwords * sizeof(uint32_t));
+	p->refcount = 1U;
+	lockAccel();
+	i = findShaderProgram(source, p->num_dwords, p->hash);
+	if (i != SHADER_PROGRAM_CACHE_SIZE) {
+		q = m_shader_programs[i];
+		++q->refcount;
+		q->lru_stamp = ++m_shader_program_clock;
+		unlockAccel();
+		freeShaderProgram(p);
+		return q;
+	}
+	if (m_shader_program_count >= SHADER_PROGRAM_CACHE_MAX &&
+		!evictShaderProgram()) {
+		unlockAccel();
+		goto fail_free;
+	}
+	p->lru_stamp = ++m_shader_program_clock;
+	i = p->hash & (SHADER_PROGRAM_CACHE_SIZE - 1U);
+	while (m_shader_programs[i])
+		i = (i + 1U) & (SHADER_PROGRAM_CACHE_SIZE - 1U);
+	m_shader_programs[i] = p;
+	++m_shader_program_count;
+	unlockAccel();
+	return p;
+
+fail_free:
+	freeShaderProgram(p);
+	return 0;
+fail:
+	if (proto->bytecode_buf)
+		IOFree(proto->bytecode_buf, proto->bytecode_len);
+	return 0;
+}
+
+HIDDEN
+void CLASS::releaseShaderProgram(ShaderProgram* program)
+{
+	if (!program)
+		return;
+	lockAccel();
+	if (program->refcount)
+		--program->refcount;
+	unlockAccel();
+}
@@ -29,11 +29,48 @@
 #define kIOMessageFindSurface iokit_vendor_specific_msg(0x10)
 
 #define AUTO_SYNC_PRESENT_FENCE_COUNT	2
+#define GMR_CACHE_SIZE					16
+#define GMR_CACHE_MAX_BYTES				(32U << 20)
+#define GMR_DESC_POOL_PAGES				4U
+#define GMR2_REMAP_CHUNK_PAGES			2048U
+#define SHADER_PROGRAM_CACHE_SIZE		128U
+#define SHADER_PROGRAM_CACHE_MAX		96U
+#define TEXTURE_HOST_BUDGET_MB			256U
+#define GL_COMMAND_BUFFERS				3U
+#define GL_COMMAND_BUFFERS_MAX			8U
 
 class CEsvga2Accel : public IOAccelerator
 {
 	OSDeclareDefaultStructors(CEsvga2Accel);
 
+public:
+	/*
+	 * Owners of VRAM, for statistics
+	 */
+	enum VRAMTag {
+		kVRAMTagScratch = 0U,
+		kVRAMTagSurfaceBacking = 1U,
+		kVRAMTagVertexArray = 2U,
+		kVRAMTagGFB = 3U,
+		kVRAMNumTags
+	};
+
+	/*
+	 * Pixel shader program, shared by all GL contexts
+	 */
+	struct ShaderProgram {
+		uint64_t hash;
+		uint32_t* source;			// copy of the i915 program, for full compare
+		uint32_t num_dwords;
+		uint32_t const* bytecode;	// SVGA3D bytecode, 0 for fixed-function
+		uint32_t* bytecode_buf;		// owned copy of bytecode, if any
+		uint32_t bytecode_len;		// in bytes
+		uint32_t tc2s_map;
+		uint8_t tc2s_map_valids;
+		uint32_t refcount;
+		uint32_t lru_stamp;
+	};
+
 private:
 	/*
 	 * Base
@@ -58,6 +95,8 @@ private:
 	int m_log_level_ga;
 	int m_log_level_gld;
 	uint32_t m_options_ga;
+	size_t m_texture_budget;
+	uint32_t m_gl_command_buffers;
 
 	/*
 	 * 3D area
@@ -79,11 +118,44 @@ private:
 		uint32_t w, h;
 	} m_primary_screen;
 
+	/*
+	 * VRAM statistics
+	 */
+	size_t m_vram_tag_bytes[kVRAMNumTags];
+	size_t m_vram_tag_peak[kVRAMNumTags];
+	uint32_t m_vram_tag_fallbacks[kVRAMNumTags];
+
 	/*
 	 * AutoSync area
 	 */
 	FenceTracker<AUTO_SYNC_PRESENT_FENCE_COUNT> m_present_tracker;
 
+	/*
+	 * GMR cache area
+	 */
+	struct GMRCacheEntry {
+		class IOMemoryDescriptor* md;	// an IOBufferMemoryDescriptor, retained and prepared while cached
+		IOByteCount length;
+		uint64_t page_hash;
+		uint32_t gmr_id;
+		uint32_t fence;					// last fence to reference the GMR
+		uint32_t refcount;
+		uint32_t lru_stamp;
+	};
+	GMRCacheEntry m_gmr_cache[GMR_CACHE_SIZE];
+	uint32_t m_gmr_cache_clock;
+	size_t m_gmr_cache_bytes;
+	class IOBufferMemoryDescriptor* m_gmr_desc_pool;	// descriptor pages for createGMR
+	size_t m_gmr_desc_pool_pages;
+	UInt32 volatile m_gmr_desc_busy;
+
+	/*
+	 * Shader program cache area, open-addressed by program hash
+	 */
+	ShaderProgram* m_shader_programs[SHADER_PROGRAM_CACHE_SIZE];
+	uint32_t m_shader_program_count;
+	uint32_t m_shader_program_clock;
+
 	/*
 	 * Video area
 	 */
@@ -109,6 +181,18 @@ private:
 	void processOptions();
 	IOReturn findFramebuffer();
 	IOReturn setupAllocator();
+	void accountVRAM(VRAMTag tag, size_t old_bytes, size_t new_bytes);
+	void publishVRAMStats();
+	static uint64_t hashPhysicalPages(class IOMemoryDescriptor* md);
+	static bool samePhysicalPages(class IOMemoryDescriptor* md1, class IOMemoryDescriptor* md2, IOByteCount length);
+	bool evictGMRCacheEntry();
+	class IOBufferMemoryDescriptor* getGMRDescriptorPages(size_t num_pages);
+	void putGMRDescriptorPages(class IOBufferMemoryDescriptor* helper);
+	size_t findShaderProgram(uint32_t const* source, uint32_t num_dwords, uint64_t hash) const;
+	static void freeShaderProgram(ShaderProgram* program);
+	void removeShaderProgram(size_t slot);
+	bool evictShaderProgram();
+	void flushShaderPrograms();
 #ifdef FB_NOTIFIER
 	IOReturn fbNotificationHandler(void* ref,
 								   class IOFramebuffer* framebuffer,
@@ -125,6 +209,7 @@ public:
 	bool init(OSDictionary* dictionary = 0);
 	bool start(IOService* provider);
 	void stop(IOService* provider);
+	bool serializeProperties(OSSerialize* s) const;
 	IOReturn newUserClient(task_t owningTask,
 						   void* securityID,
 						   UInt32 type,
@@ -136,6 +221,8 @@ public:
 	IOReturn SyncFIFO();
 	IOReturn RingDoorBell();
 	IOReturn SyncToFence(uint32_t fence);
+	bool HasFencePassed(uint32_t fence) const;
+	uint32_t InsertFence();
 
 	/*
 	 * Methods for supporting CEsvga22DContext
@@ -205,11 +292,22 @@ public:
 						 uint32_t dst_sid,
 						 void /* IOAccelDeviceRegion */ const* region,
 						 ExtraInfo const* extra);
+	IOReturn surfaceCopy(SVGA3dSurfaceImageId const* srcImage,
+						 SVGA3dSurfaceImageId const* dstImage,
+						 SVGA3dCopyBox const* copyBoxes,
+						 size_t numCopyBoxes);
 	IOReturn surfaceStretch(uint32_t src_sid,
 							uint32_t dst_sid,
 							SVGA3dStretchBltMode mode,
 							void /* IOAccelBounds */ const* src_rect,
 							void /* IOAccelBounds */ const* dest_rect);
+	IOReturn surfaceStretch(SVGA3dSurfaceImageId const* srcImage,
+							SVGA3dSurfaceImageId const* dstImage,
+							SVGA3dStretchBltMode mode,
+							SVGA3dBox const* srcBox,
+							SVGA3dBox const* dstBox);
+	IOReturn generateMipmaps(uint32_t sid,
+							 SVGA3dTextureFilter filter);
 	IOReturn surfacePresentAutoSync(uint32_t sid,
 									void /* IOAccelDeviceRegion */ const* region,
 									ExtraInfo const* extra);
@@ -241,6 +339,12 @@ public:
 							SVGA3dCopyBox const* copyBox,
 							ExtraInfoEx const* extra,
 							uint32_t* fence = 0);
+	IOReturn surfaceDMA3DEx(SVGA3dSurfaceImageId const* hostImage,
+							SVGA3dTransferType transfer,
+							SVGA3dCopyBox const* copyBoxes,
+							size_t numCopyBoxes,
+							ExtraInfoEx const* extra,
+							uint32_t* fence = 0);
 
 	/*
 	 * Screen Methods
@@ -285,6 +389,8 @@ public:
 	int getLogLevelGA() const { return m_log_level_ga; }
 	int getLogLevelGLD() const { return m_log_level_gld; }
 	uint32_t getOptionsGA() const { return m_options_ga; }
+	size_t getTextureBudget() const { return m_texture_budget; }
+	uint32_t getGLCommandBuffers() const { return m_gl_command_buffers; }
 	IOReturn getBlitBugResult() const { return m_blitbug_result; }
 	void cacheBlitBugResult(IOReturn r) { m_blitbug_result = r; }
 	void lockAccel();
@@ -342,9 +448,10 @@ public:
 	/*
 	 * Memory Support
 	 */
-	void* VRAMMalloc(size_t bytes);
-	void* VRAMRealloc(void* ptr, size_t bytes);
-	void VRAMFree(void* ptr);
+	void* VRAMMalloc(size_t bytes, VRAMTag tag = kVRAMTagScratch);
+	void* VRAMRealloc(void* ptr, size_t bytes, VRAMTag tag = kVRAMTagScratch);
+	void VRAMFree(void* ptr, VRAMTag tag = kVRAMTagScratch);
+	void VRAMFallbackToGMR(VRAMTag tag);
 	IOMemoryMap* mapVRAMRangeForTask(task_t task, vm_offset_t offset_in_vram, vm_size_t size);
 
 	/*
@@ -354,6 +461,20 @@ public:
 	IOReturn destroyGMR(uint32_t gmrId);
 	IOReturn createGMR2(uint32_t gmrId, IOMemoryDescriptor* md);
 	IOReturn destroyGMR2(uint32_t gmrId);
+
+	/*
+	 * GMR Cache
+	 */
+	IOReturn acquireGMR(class IOMemoryDescriptor* md, uint32_t* gmrId);
+	void releaseGMR(uint32_t gmrId, uint32_t fence);
+	void flushGMRCache();
+
+	/*
+	 * Shader Program Cache
+	 */
+	ShaderProgram* acquireShaderProgram(uint32_t const* source, uint32_t num_dwords, uint64_t hash);
+	ShaderProgram* addShaderProgram(ShaderProgram const* proto);
+	void releaseShaderProgram(ShaderProgram* program);
 };
 
 #endif /* __CESVGA2ACCEL_H__ */
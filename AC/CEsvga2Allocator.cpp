@@ -407,6 +407,9 @@ IOReturn CLASS::BuddyMalloc(int bits, void **newStore)
 	 * accounts for chunks about to be freed again by toFree
 	 */
 	toFree(past, offset + (POOL_ONE << retBits), false);
+	++liveList[bits];
+	if (poolBytes - freeBytes > peakBytes)
+		peakBytes = poolBytes - freeBytes;
 	*newStore = ptr;
 	return kIOReturnSuccess;
 }
@@ -494,7 +497,7 @@ IOReturn CLASS::Init(void* startAddress, size_t bytes)
 	int i;
 	size_t setBits;
 	int const minBits = 12;
-	int const numSizes = 13;
+	int const numSizes = ALLOCATOR_NUM_SIZES;
 
 #if 1
 	if ((1UL << minBits) < sizeof(pool_size_t) * FREEBLOCK)
@@ -518,14 +521,19 @@ IOReturn CLASS::Init(void* startAddress, size_t bytes)
 	if (!map)
 		return kIOReturnNoMemory;
 	freeBytes = 0U;
+	poolBytes = 0U;
+	peakBytes = 0U;
+	failCount = 0U;
 	/*
 	 * The bitmap will think everything is allocated, so areas
 	 * not handed over to us will not get merged in with any
 	 * freed blocks
 	 */
 	memset(map, 0xFFU, (setBits + 7U) >> 3);
-	for (i = 0; i < numSizes; ++i)
+	for (i = 0; i < numSizes; ++i) {
 		freeList[i] = OURNULL;
+		liveList[i] = 0U;
+	}
 	return kIOReturnSuccess;
 }
 
@@ -565,6 +573,7 @@ IOReturn CLASS::Release(size_t startOffsetBytes, size_t endOffsetBytes)
 		   true
 #endif
 		   );
+	poolBytes += static_cast<pool_size_t>((pastBlockOff - startBlock) << minBits);
 	return kIOReturnSuccess;
 }
 
@@ -572,17 +581,25 @@ IOReturn CLASS::Malloc(size_t bytes, void** newStore)
 {
 	int bits;
 	size_t size;
+	IOReturn ret;
 	if (!newStore)
 		return kIOReturnBadArgument /* "null pointer to new store" */;
 	size = 1UL << minBits;
 	for (bits = 0; size < bytes; ++bits) {
 		if (bits >= numSizes)
-			return kIOReturnNoResources;	// can't allocate blocks this size
+			goto too_big;
 		size <<= 1;
 		if (!size)
-			return kIOReturnNoResources;	// can't allocate blocks this size
+			goto too_big;
     }
-	return BuddyMalloc(bits, newStore);
+	ret = BuddyMalloc(bits, newStore);
+	if (ret == kIOReturnNoMemory)
+		++failCount;
+	return ret;
+
+too_big:
+	++failCount;
+	return kIOReturnNoResources;	// can't allocate blocks this size
 }
 
 IOReturn CLASS::Realloc(void* ptrv, size_t size, void** newPtr)
@@ -620,6 +637,8 @@ IOReturn CLASS::Realloc(void* ptrv, size_t size, void** newPtr)
 	 * set end bits to mark new size
 	 */
 	BITSET(this, blockNo + newBlocks - 1U);
+	--liveList[bits];
+	++liveList[canBits - minBits];
 
 #ifdef FRAGILE
 	BITCLEAR(this, blockNo + oldBlocks - 1U);
@@ -762,6 +781,7 @@ IOReturn CLASS::Free(void* storage2)
 	pastPtr[OFF_BITS] = static_cast<pool_size_t>(bits + LEN_OFFSET);
 	freeList[bits] = blockOff;
 	freeBytes += (POOL_ONE << (oldBits + minBits));
+	--liveList[oldBits];
 	return kIOReturnSuccess;
 }
 
@@ -819,3 +839,46 @@ IOReturn CLASS::Check(size_t* counts)
 		return kIOReturnInternalError /* "store accounting does not balance" */;
 	return kIOReturnSuccess;
 }
+
+IOReturn CLASS::AllocSize(void const* ptr, size_t* bytes)
+{
+	IOReturn ret;
+	int bits;
+	if (!bytes)
+		return kIOReturnBadArgument /* "nowhere to store result" */;
+	ret = BuddyAllocSize(ptr, &bits);
+	if (ret != kIOReturnSuccess)
+		return ret;
+	*bytes = 1UL << (bits + minBits);
+	return kIOReturnSuccess;
+}
+
+/*
+ * Unlike Check(), this only walks the free lists to count them, so
+ *   it's cheap enough to call whenever the statistics are read.
+ */
+IOReturn CLASS::Statistics(CEsvga2AllocatorStats* stats)
+{
+	int size;
+	if (!stats)
+		return kIOReturnBadArgument /* "no room to store statistics" */;
+	bzero(stats, sizeof *stats);
+	if (!map)
+		return kIOReturnNotReady;
+	stats->poolBytes = poolBytes;
+	stats->freeBytes = freeBytes;
+	stats->peakBytes = peakBytes;
+	stats->failures = failCount;
+	for (size = 0; size < numSizes; ++size) {
+		pool_size_t offset, blocksSeen = 0U;
+		pool_size_t maxBlocks = poolBlocks >> size;
+		for (offset = freeList[size];
+			 offset != OURNULL && offset < poolBlocks && blocksSeen < maxBlocks; ++blocksSeen)
+			offset = reinterpret_cast<pool_size_t*>(poolStart + (offset << minBits))[OFF_NEXT];
+		stats->freeBlocks[size] = blocksSeen;
+		stats->liveBlocks[size] = liveList[size];
+		if (blocksSeen)
+			stats->largestFree = 1UL << (size + minBits);
+	}
+	return kIOReturnSuccess;
+}
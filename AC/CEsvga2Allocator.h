@@ -25,6 +25,19 @@
 #include <libkern/OSTypes.h>
 #include <IOKit/IOReturn.h>
 
+#define ALLOCATOR_NUM_SIZES 13
+
+struct CEsvga2AllocatorStats
+{
+	size_t poolBytes;		// bytes handed over by Release()
+	size_t freeBytes;
+	size_t peakBytes;		// high-water mark of bytes in use
+	size_t largestFree;		// largest block available without merging
+	uint32_t failures;		// Malloc() calls that could not be satisfied
+	uint32_t freeBlocks[ALLOCATOR_NUM_SIZES];	// free list lengths, by size class
+	uint32_t liveBlocks[ALLOCATOR_NUM_SIZES];	// allocated blocks, by size class
+};
+
 class CEsvga2Allocator : public OSObject
 {
 	OSDeclareDefaultStructors(CEsvga2Allocator);
@@ -37,10 +50,18 @@ private:
 
 	int minBits;			// Minimum block size is 1 << minBits (expect 12 = log_2(PAGE_SIZE))
 	int numSizes;			// sizes go up by powers of two (expect 13, max block == 2^24 bytes == SVGA_FB_MAX_TRACEABLE_SIZE)
-	pool_size_t freeList[13];	// free lists
+	pool_size_t freeList[ALLOCATOR_NUM_SIZES];	// free lists
 	uint8_t* map;			// bit map
 	pool_size_t freeBytes;
 
+	/*
+	 * Statistics
+	 */
+	pool_size_t poolBytes;
+	pool_size_t peakBytes;
+	pool_size_t liveList[ALLOCATOR_NUM_SIZES];	// allocated blocks, by size class
+	uint32_t failCount;
+
 	static bool memAll(void const *p, size_t bytes);
 	bool testAll(size_t firstBit, size_t pastBit);
 	void clearAll(size_t firstBit, size_t pastBit);
@@ -72,6 +93,8 @@ public:
 	IOReturn Free(void* storage2);
 	IOReturn Available(size_t* bytesFree);
 	IOReturn Check(size_t* counts);
+	IOReturn AllocSize(void const* ptr, size_t* bytes);
+	IOReturn Statistics(CEsvga2AllocatorStats* stats);
 };
 
 #endif /* __CESVGA2ALLOCATOR_H__ */
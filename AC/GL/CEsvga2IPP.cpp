@@ -21,12 +21,16 @@
 #include <IOKit/IOLib.h>
 #include <IOKit/graphics/IOAccelSurfaceConnect.h>
 #include <libkern/crypto/md5.h>
+#define GL_INCL_SHARED
 #define GL_INCL_PRIVATE
 #include "GLCommon.h"
 #include "Shaders.h"
+#include "ShaderTranslator.h"
 #include "UCGLDCommonTypes.h"
 #include "VLog.h"
+#include "ce1_options_ac.h"
 #include "CEsvga2Accel.h"
+#include "CEsvga2Shared.h"
 #include "CEsvga2IPP.h"
 
 #define CLASS CEsvga2IPP
@@ -41,15 +45,15 @@ OSDefineMetaClassAndStructors(CEsvga2IPP, OSObject);
 
 #define HIDDEN __attribute__((visibility("hidden")))
 
-#define MAX_NUM_DECLS 12U
-
 #define TC2S_MAP_ID 0x76543210U
+#define VFMT_S4_MASK 0x1DC4U	/* S4 bits analyze_vertex_format looks at */
 #define TC2S_MAP_ID_VALIDS 255U
 
 #define PRINT_PS 1
 #define DETAIL_COORD 3
 
 typedef float __v4sf __attribute__((vector_size(16), may_alias));
+typedef float __v2sf __attribute__((vector_size(8), may_alias));
 
 #pragma mark -
 #pragma mark Some Strings
@@ -103,14 +107,53 @@ union DefineRegion
 	IOAccelDeviceRegion r;
 };
 
-struct ShaderEntry
+/*
+ * Texture coordinates to adjust in each vertex
+ */
+struct AdjustPlan
+{
+	size_t num_coords;
+	size_t offset[8];				// in floats
+	float const* scale[8];			// 1/width, 1/height of the sampled texture
+};
+
+/*
+ * i915 commands are looked up per class (bits 29-31) in
+ *   a table indexed by the class's opcode bits
+ */
+struct DecodeClass
+{
+	CEsvga2IPP::DecodeEntry const* table;
+	uint8_t shift;
+	uint8_t mask;
+};
+
+typedef void (*adjust_kernel_t)(uint8_t* vertex_array,
+								size_t num_vertices,
+								size_t stride,
+								AdjustPlan const* plan);
+
+#pragma mark -
+#pragma mark Decode Tables
+#pragma mark -
+
+static CEsvga2IPP::DecodeEntry decode_mi_table[64];
+static CEsvga2IPP::DecodeEntry decode_2d_table[128];
+static CEsvga2IPP::DecodeEntry decode_3d_table[32];
+static CEsvga2IPP::DecodeEntry decode_3d_1d_table[256];
+static UInt32 volatile decode_tables_state;	// 0 - empty, 1 - building, 2 - built
+
+static
+DecodeClass const decode_classes[8] =
 {
-	uint8_t md5[MD5_DIGEST_LENGTH];
-	SVGA3dShaderType shader_type;
-	uint32_t shader_id;
-	uint32_t tc2s_map;
-	uint8_t tc2s_map_valids;
-	ShaderEntry* next;
+	{ &decode_mi_table[0], 23U, 0x3FU },	/* MI */
+	{ 0, 0U, 0U },
+	{ &decode_2d_table[0], 22U, 0x7FU },	/* 2D */
+	{ &decode_3d_table[0], 24U, 0x1FU },	/* 3D */
+	{ 0, 0U, 0U },
+	{ 0, 0U, 0U },
+	{ 0, 0U, 0U },
+	{ 0, 0U, 0U },
 };
 
 #pragma mark -
@@ -129,6 +172,27 @@ void memset32(void* dest, uint32_t value, size_t size)
 	__asm__ volatile ("cld; rep stosl" : "+c" (size), "+D" (dest) : "a" (value) : "memory");
 }
 
+/*
+ * 64-bit hash of a dword stream, after xxHash64's
+ *   4-byte lane and avalanche
+ */
+static
+uint64_t hash_dwords(uint32_t const* p, uint32_t num_dwords)
+{
+	uint64_t h = 0x27D4EB2F165667C5ULL + num_dwords * sizeof(uint32_t);
+
+	for (; num_dwords; --num_dwords, ++p) {
+		h ^= *p * 0x9E3779B185EBCA87ULL;
+		h = ((h << 23) | (h >> 41)) * 0xC2B2AE3D27D4EB4FULL + 0x165667B19E3779F9ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xC2B2AE3D27D4EB4FULL;
+	h ^= h >> 29;
+	h *= 0x165667B19E3779F9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
 static
 uint8_t get4bits_64(uint64_t const* v, uint8_t index)
 {
@@ -407,39 +471,212 @@ set_strides:
 	return kIOReturnSuccess;
 }
 
+/*
+ * Fills in type and count of a primitive,
+ *   false if there's nothing to draw
+ */
 static
-void make_polygon_index_array(uint16_t* arr, uint16_t base_index, uint16_t num_vertices)
+bool set_primitive_range(uint32_t prim_kind, size_t num_vertices, SVGA3dPrimitiveRange* range)
 {
-	uint16_t v1, v2;
-	if (!num_vertices)
-		return;
-	v1 = 0U;
-	v2 = num_vertices - 1U;
-	*arr++ = base_index + (v1++);
-	while (v1 < v2) {
-		*arr++ = base_index + (v1++);
-		*arr++ = base_index + (v2--);
+	switch (prim_kind) {
+		case 0: /* PRIM3D_TRILIST */
+			if (num_vertices < 3U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices / 3U);
+			break;
+		case 1: /* PRIM3D_TRISTRIP */
+			if (num_vertices < 3U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_TRIANGLESTRIP;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices - 2U);
+			break;
+		case 2: /* PRIM3D_TRISTRIP_RVRSE */
+			if (num_vertices < 3U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_TRIANGLESTRIP;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices - 1U);	// includes a degenerate
+			break;
+		case 3: /* PRIM3D_TRIFAN */
+		case 4: /* PRIM3D_POLY */
+			/*
+			 * Polygons are fans around the first vertex.  This only
+			 *   holds for smooth shading, as a flat shaded fan takes
+			 *   the color of v[i + 1] rather than v[0]; see
+			 *   make_flat_polygon_index_array.
+			 */
+			if (num_vertices < 3U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_TRIANGLEFAN;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices - 2U);
+			break;
+		case 5: /* PRIM3D_LINELIST */
+			if (num_vertices < 2U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_LINELIST;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices >> 1);
+			break;
+		case 6: /* PRIM3D_LINESTRIP */
+			if (num_vertices < 2U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_LINESTRIP;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices - 1U);
+			break;
+		case 7: /* PRIM3D_RECTLIST */
+			if (num_vertices < 3U)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices / 3U) * 2U;
+			break;
+		case 8: /* PRIM3D_POINTLIST */
+			if (!num_vertices)
+				return false;
+			range->primType = SVGA3D_PRIMITIVE_POINTLIST;
+			range->primitiveCount = static_cast<uint32_t>(num_vertices);
+			break;
+		default:
+			return false;	// error, shouldn't get here
+	}
+	return true;
+}
+
+/*
+ * Makes a triangle list of the polygon (0, i + 1, i + 2), so that
+ *   v[0] comes first in every triangle, and is the one D3D takes
+ *   the flat shaded color from, as GL does for polygons.
+ *   Vertices are indices[k] if given, else base_index + k.
+ */
+static
+void make_flat_polygon_index_array(uint16_t* arr,
+								   uint16_t const* indices,
+								   uint16_t base_index,
+								   size_t num_vertices)
+{
+	size_t i;
+
+	for (i = 1U; i + 1U < num_vertices; ++i) {
+		*arr++ = indices ? indices[0] : base_index;
+		*arr++ = indices ? indices[i] : static_cast<uint16_t>(base_index + i);
+		*arr++ = indices ? indices[i + 1U] : static_cast<uint16_t>(base_index + i + 1U);
 	}
-	if (v1 == v2)
-		*arr = base_index + v1;
 }
 
+/*
+ * Expands each rectangle of 3 vertices (max corner, then
+ *   min x, then min corner) into two triangles.  The implied
+ *   fourth vertex is v0 + v2 - v1 in every attribute.
+ */
 static
-void flatshade_polygon(uint8_t* vertex_array,
-					   size_t num_vertices,
-					   SVGA3dVertexDecl const* decls,
-					   size_t num_decls)
-{
-	size_t i, j;
-
-	for (i = 0U; i != num_decls; ++i)
-		if (decls[i].identity.type == SVGA3D_DECLTYPE_D3DCOLOR) {
-			uint8_t* p = vertex_array + decls[i].array.offset;
-			uint32_t color = *reinterpret_cast<uint32_t const*>(p);
-			p += decls[i].array.stride;
-			for (j = 1U; j != num_vertices; ++j, p += decls[i].array.stride)
-				*reinterpret_cast<uint32_t*>(p) = color;
+void expand_rectlist(uint8_t* out,
+					 uint8_t const* in,
+					 size_t num_rects,
+					 SVGA3dVertexDecl const* decls,
+					 size_t num_decls)
+{
+	size_t r, i, k, n, stride = decls[0].array.stride;
+	uint8_t const *v0, *v1, *v2;
+	uint8_t* v3;
+	int c;
+
+	for (r = 0U; r != num_rects; ++r, in += 3U * stride, out += 6U * stride) {
+		v0 = in;
+		v1 = in + stride;
+		v2 = in + 2U * stride;
+		v3 = out + 5U * stride;
+		memcpy(out, in, 3U * stride);
+		memcpy(out + 3U * stride, v0, stride);
+		memcpy(out + 4U * stride, v2, stride);
+		memcpy(v3, v0, stride);
+		for (i = 0U; i != num_decls; ++i) {
+			k = decls[i].array.offset;
+			switch (decls[i].identity.type) {
+				case SVGA3D_DECLTYPE_FLOAT1:
+				case SVGA3D_DECLTYPE_FLOAT2:
+				case SVGA3D_DECLTYPE_FLOAT3:
+				case SVGA3D_DECLTYPE_FLOAT4:
+					for (n = decls[i].identity.type - SVGA3D_DECLTYPE_FLOAT1 + 1U; n; --n, k += sizeof(float))
+						*reinterpret_cast<float*>(v3 + k) =
+							*reinterpret_cast<float const*>(v0 + k) +
+							*reinterpret_cast<float const*>(v2 + k) -
+							*reinterpret_cast<float const*>(v1 + k);
+					break;
+				case SVGA3D_DECLTYPE_D3DCOLOR:
+					for (n = 4U; n; --n, ++k) {
+						c = static_cast<int>(v0[k]) + v2[k] - v1[k];
+						v3[k] = static_cast<uint8_t>(c < 0 ? 0 : (c > 255 ? 255 : c));
+					}
+					break;
+				default:
+					break;	// keep v0's
+			}
 		}
+	}
+}
+
+static inline
+void adjust_coord(float* q, float const* scale)
+{
+#ifdef VECTORIZE
+	static __v2sf const halves = { 0.5F, 0.5F };
+	*reinterpret_cast<__v2sf*>(q) = (*reinterpret_cast<__v2sf const*>(q) + halves) * *reinterpret_cast<__v2sf const*>(scale);
+#else
+	q[0] = (q[0] + 0.5F) * scale[0];
+	q[1] = (q[1] + 0.5F) * scale[1];
+#endif
+}
+
+/*
+ * Converts non-normalized texture coordinates to normalized.
+ *   STRIDE and NUM_COORDS are fixed for common vertex formats
+ *   so the loops unroll, 0 means given at runtime.
+ */
+template<size_t STRIDE, size_t NUM_COORDS>
+static
+void adjust_coords_kernel(uint8_t* vertex_array,
+						  size_t num_vertices,
+						  size_t stride,
+						  AdjustPlan const* plan)
+{
+	size_t j, k, num_coords = NUM_COORDS ? NUM_COORDS : plan->num_coords;
+	float* v;
+
+	if (STRIDE)
+		stride = STRIDE;
+	for (j = 0U; j != num_vertices; ++j, vertex_array += stride) {
+		v = reinterpret_cast<float*>(vertex_array);
+		for (k = 0U; k != num_coords; ++k)
+			adjust_coord(v + plan->offset[k], plan->scale[k]);
+	}
+}
+
+/*
+ * The GLD sends XYZW, diffuse, [specular], FLOAT4 texcoords
+ */
+static
+struct {
+	uint32_t stride;
+	uint32_t num_coords;
+	adjust_kernel_t kernel;
+} const adjust_kernels[] =
+{
+	{ 36U, 1U, &adjust_coords_kernel<36U, 1U> },
+	{ 40U, 1U, &adjust_coords_kernel<40U, 1U> },
+	{ 52U, 1U, &adjust_coords_kernel<52U, 1U> },
+	{ 52U, 2U, &adjust_coords_kernel<52U, 2U> },
+	{ 56U, 1U, &adjust_coords_kernel<56U, 1U> },
+	{ 56U, 2U, &adjust_coords_kernel<56U, 2U> },
+};
+
+static
+adjust_kernel_t select_adjust_kernel(size_t stride, size_t num_coords)
+{
+	size_t i;
+
+	for (i = 0U; i != sizeof adjust_kernels / sizeof adjust_kernels[0]; ++i)
+		if (adjust_kernels[i].stride == stride &&
+			adjust_kernels[i].num_coords == num_coords)
+			return adjust_kernels[i].kernel;
+	return &adjust_coords_kernel<0U, 0U>;
 }
 
 #pragma mark -
@@ -452,7 +689,10 @@ void CLASS::Init()
 	m_log_level = LOGGING_LEVEL;
 	m_context_id = SVGA_ID_INVALID;
 	m_active_shid = SVGA_ID_INVALID - 1;
-	m_arrays.init();
+	m_arrays.init(SVGA3D_SURFACE_HINT_VERTEXBUFFER);
+	m_vb_array.init(SVGA3D_SURFACE_HINT_VERTEXBUFFER);
+	m_index_array.init(SVGA3D_SURFACE_HINT_INDEXBUFFER);
+	m_vb.sid = SVGA_ID_INVALID;
 	memset32(&surface_ids[0], SVGA_ID_INVALID, 16U);
 }
 
@@ -471,75 +711,194 @@ void CLASS::Cleanup()
 		m_provider->FreeContextID(m_context_id);
 		m_context_id = SVGA_ID_INVALID;
 	}
+	m_batch.num_ranges = 0U;
 	m_arrays.purge(m_provider);
+	m_vb_array.purge(m_provider);
+	m_index_array.purge(m_provider);
 no_provider:
+	set_vertex_buffer(0, 0U, 0U);
 	if (m_float_cache) {
 		IOFreeAligned(m_float_cache, 64U * sizeof(float));
 		m_float_cache = 0;
 	}
 }
 
+/*
+ * Describes a program not yet known to the accelerator,
+ *   translating it to ps_2_0 bytecode
+ */
 HIDDEN
-ShaderEntry const* CLASS::cache_shader(uint32_t const* source, uint32_t num_dwords)
+void CLASS::prepare_shader_program(CEsvga2Accel::ShaderProgram* program,
+								   uint32_t const* source,
+								   uint32_t num_dwords)
 {
 	MD5_CTX md5_ctx;
 	uint8_t hash[MD5_DIGEST_LENGTH];
-	ShaderEntry *e, *f;
-	SVGA3D* svga3d;
 	uint32_t i;
 
-	if (!source || !num_dwords)
-		return 0;
+	program->source = const_cast<uint32_t*>(source);
+	program->num_dwords = num_dwords;
+	program->bytecode = 0;
+	program->bytecode_buf = 0;
+	program->bytecode_len = 0U;
+	program->tc2s_map = TC2S_MAP_ID;
+	program->tc2s_map_valids = TC2S_MAP_ID_VALIDS;
+	program->refcount = 0U;
+	program->lru_stamp = 0U;
+	if (translate_i915_program(source,
+							   num_dwords,
+							   &program->bytecode_buf,
+							   &program->bytecode_len,
+							   &program->tc2s_map,
+							   &program->tc2s_map_valids) == kIOReturnSuccess) {
+		program->bytecode = program->bytecode_buf;
+#if LOGGING_LEVEL < DETAIL_COORD
+		return;
+#endif
+	}
+	/*
+	 * Canned shaders are a fallback for programs the translator
+	 *   rejects, and a cross-check when logging in detail
+	 */
 	MD5Init(&md5_ctx);
 	MD5Update(&md5_ctx, source, static_cast<unsigned>(num_dwords * sizeof(uint32_t)));
 	MD5Final(&hash[0], &md5_ctx);
-	for (f = 0, e = m_shader_cache; e; f = e, e = e->next)
-		if (!memcmp(&hash[0], &e->md5[0], sizeof hash)) {
-			if (e != m_shader_cache) {
-				/*
-				 * move-to-front
-				 */
-				if (f)
-					f->next = e->next;
-				e->next = m_shader_cache;
-				m_shader_cache = e;
-			}
-			return e;
-		}
-	e = static_cast<typeof e>(IOMalloc(sizeof *e));
-	if (!e)
-		return 0;
-	memcpy(&e->md5[0], &hash[0], sizeof hash);
-	e->shader_type = SVGA3D_SHADERTYPE_PS;
-	e->shader_id = SVGA_ID_INVALID;
-	e->tc2s_map = TC2S_MAP_ID;
-	e->tc2s_map_valids = TC2S_MAP_ID_VALIDS;
-	e->next = m_shader_cache;
-	m_shader_cache = e;
 	for (i = 0U; i != NUM_FIXED_SHADERS; ++i)
 		if (!memcmp(&hash[0], &g_fixed_shaders[i].hash[0], sizeof hash)) {
-			svga3d = m_provider->lock3D();
-			if (!svga3d)
-				return e;
-			e->shader_id = m_next_shid++;
-			svga3d->DefineShader(m_context_id,
-								 e->shader_id,
-								 e->shader_type,
-								 reinterpret_cast<uint32_t const*>(g_fixed_shaders[i].bytecode),
-								 g_fixed_shaders[i].length);	// Note: ignores error
-			m_provider->unlock3D();
+			if (program->bytecode) {
 #if LOGGING_LEVEL >= DETAIL_COORD
-			PPLog(3, "%s: Shader %u mapped to canned %u\n", __FUNCTION__, e->shader_id, i);
+				PPLog(3, "%s: Program %#llx translated, canned %u tc2s map %s\n", __FUNCTION__,
+					  program->hash, i,
+					  program->tc2s_map == g_fixed_shaders[i].tc2s_map ? "matches" : "differs");
 #endif
-			e->tc2s_map = g_fixed_shaders[i].tc2s_map;
-			e->tc2s_map_valids = g_fixed_shaders[i].tc2s_map_valids;
-			return e;
+				return;
+			}
+#if LOGGING_LEVEL >= DETAIL_COORD
+			PPLog(3, "%s: Program %#llx mapped to canned %u\n", __FUNCTION__, program->hash, i);
+#endif
+			program->bytecode = reinterpret_cast<uint32_t const*>(g_fixed_shaders[i].bytecode);
+			program->bytecode_len = g_fixed_shaders[i].length;
+			program->tc2s_map = g_fixed_shaders[i].tc2s_map;
+			program->tc2s_map_valids = g_fixed_shaders[i].tc2s_map_valids;
+			return;
 		}
+	if (program->bytecode)
+		return;
 #ifdef PRINT_PS
 	PPLog(PRINT_PS, "%s: shader hash { %#llx, %#llx }\n", __FUNCTION__,
 		  *reinterpret_cast<uint64_t const*>(&hash[0]),
 		  *reinterpret_cast<uint64_t const*>(&hash[8]));
 	ip_print_ps(source, num_dwords);
+#endif
+}
+
+/*
+ * Evicts the least recently used shader from this context
+ */
+HIDDEN
+void CLASS::evict_shader()
+{
+	ShaderEntry victim;
+	SVGA3D* svga3d;
+	size_t i, home, slot = SHADER_CACHE_SIZE;
+	uint32_t const mask = SHADER_CACHE_SIZE - 1U;
+
+	for (i = 0U; i != SHADER_CACHE_SIZE; ++i) {
+		if (!m_shader_cache[i].program)
+			continue;
+		if (slot == SHADER_CACHE_SIZE ||
+			static_cast<int>(m_shader_cache[i].lru_stamp - m_shader_cache[slot].lru_stamp) < 0)
+			slot = i;
+	}
+	if (slot == SHADER_CACHE_SIZE)
+		return;
+	victim = m_shader_cache[slot];
+	--m_shader_cache_count;
+	/*
+	 * Shift back the rest of the probe sequence
+	 */
+	for (i = (slot + 1U) & mask; m_shader_cache[i].program; i = (i + 1U) & mask) {
+		home = m_shader_cache[i].hash & mask;
+		if (((i - home) & mask) < ((i - slot) & mask))
+			continue;
+		m_shader_cache[slot] = m_shader_cache[i];
+		slot = i;
+	}
+	bzero(&m_shader_cache[slot], sizeof m_shader_cache[slot]);
+	if (isIdValid(victim.shader_id)) {
+		svga3d = m_provider->lock3D();
+		if (svga3d) {
+			if (victim.shader_id == m_active_shid) {
+				svga3d->SetShader(m_context_id, victim.shader_type, SVGA_ID_INVALID);
+				m_active_shid = SVGA_ID_INVALID - 1;
+			}
+			svga3d->DestroyShader(m_context_id, victim.shader_id, victim.shader_type);
+			m_provider->unlock3D();
+		}
+		m_shader_id_mask &= ~(1ULL << victim.shader_id);
+	}
+	m_provider->releaseShaderProgram(victim.program);
+}
+
+HIDDEN
+CLASS::ShaderEntry const* CLASS::cache_shader(uint32_t const* source, uint32_t num_dwords)
+{
+	CEsvga2Accel::ShaderProgram proto, *program;
+	ShaderEntry* e;
+	SVGA3D* svga3d;
+	uint64_t hash;
+	size_t i;
+	uint32_t const mask = SHADER_CACHE_SIZE - 1U;
+
+	if (!source || !num_dwords)
+		return 0;
+	hash = hash_dwords(source, num_dwords);
+	for (i = hash & mask; m_shader_cache[i].program; i = (i + 1U) & mask) {
+		e = &m_shader_cache[i];
+		if (e->hash == hash &&
+			e->program->num_dwords == num_dwords &&
+			!memcmp(e->program->source, source, num_dwords * sizeof(uint32_t))) {
+			e->lru_stamp = ++m_shader_cache_clock;
+			return e;
+		}
+	}
+	program = m_provider->acquireShaderProgram(source, num_dwords, hash);
+	if (!program) {
+		proto.hash = hash;
+		prepare_shader_program(&proto, source, num_dwords);
+		program = m_provider->addShaderProgram(&proto);
+		if (!program)
+			return 0;
+	}
+	if (m_shader_cache_count >= SHADER_CACHE_MAX)
+		evict_shader();
+	i = hash & mask;
+	while (m_shader_cache[i].program)
+		i = (i + 1U) & mask;
+	e = &m_shader_cache[i];
+	e->hash = hash;
+	e->program = program;
+	e->shader_type = SVGA3D_SHADERTYPE_PS;
+	e->shader_id = SVGA_ID_INVALID;
+	e->tc2s_map = program->tc2s_map;
+	e->tc2s_map_valids = program->tc2s_map_valids;
+	e->lru_stamp = ++m_shader_cache_clock;
+	++m_shader_cache_count;
+	if (!program->bytecode)
+		return e;
+	svga3d = m_provider->lock3D();
+	if (!svga3d)
+		return e;
+	e->shader_id = static_cast<uint32_t>(__builtin_ctzll(~m_shader_id_mask));
+	m_shader_id_mask |= (1ULL << e->shader_id);
+	svga3d->DefineShader(m_context_id,
+						 e->shader_id,
+						 e->shader_type,
+						 program->bytecode,
+						 program->bytecode_len);	// Note: ignores error
+	m_provider->unlock3D();
+#if LOGGING_LEVEL >= DETAIL_COORD
+	PPLog(3, "%s: Shader %u defined for program %#llx\n", __FUNCTION__, e->shader_id, hash);
 #endif
 	return e;
 }
@@ -547,30 +906,33 @@ ShaderEntry const* CLASS::cache_shader(uint32_t const* source, uint32_t num_dwor
 HIDDEN
 void CLASS::purge_shader_cache()
 {
-	ShaderEntry *e, *f;
 	SVGA3D* svga3d;
-	if (!m_provider || !isIdValid(m_context_id))
-		goto just_delete_them;
+	size_t i;
+
+	if (!m_provider)
+		return;
+	if (!isIdValid(m_context_id))
+		goto release_programs;
 	svga3d = m_provider->lock3D();
 	if (!svga3d)
-		goto just_delete_them;
+		goto release_programs;
 	svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, SVGA_ID_INVALID);
 #if 1
 	svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_VS, SVGA_ID_INVALID);
 #endif
 	m_active_shid = SVGA_ID_INVALID - 1;
-	for (e = m_shader_cache; e; e = e->next)
-		if (isIdValid(e->shader_id))
-			svga3d->DestroyShader(m_context_id, e->shader_id, e->shader_type);
+	for (i = 0U; i != SHADER_CACHE_SIZE; ++i)
+		if (m_shader_cache[i].program && isIdValid(m_shader_cache[i].shader_id))
+			svga3d->DestroyShader(m_context_id, m_shader_cache[i].shader_id, m_shader_cache[i].shader_type);
 	m_provider->unlock3D();
 
-just_delete_them:
-	for (e = m_shader_cache; e; e = f) {
-		f = e->next;
-		IOFree(e, sizeof *e);
-	}
-	m_shader_cache = 0;
-	m_next_shid = 0U;
+release_programs:
+	for (i = 0U; i != SHADER_CACHE_SIZE; ++i)
+		if (m_shader_cache[i].program)
+			m_provider->releaseShaderProgram(m_shader_cache[i].program);
+	bzero(&m_shader_cache[0], sizeof m_shader_cache);
+	m_shader_cache_count = 0U;
+	m_shader_id_mask = 0ULL;
 }
 
 HIDDEN
@@ -635,57 +997,36 @@ void CLASS::adjust_texture_coords(uint8_t const* map,
 								  void const* decls,
 								  size_t num_decls) const
 {
-#ifdef VECTORIZE
-	static __attribute__((aligned(8)))
-	float const const_halves[2] = { 0.5F, 0.5F };
-	__v4sf xmm0, xmm1, xmm2;
-#endif
 	SVGA3dVertexDecl const* _decls = static_cast<SVGA3dVertexDecl const*>(decls);
-	size_t i, j;
+	AdjustPlan plan;
+	size_t i;
+#if LOGGING_LEVEL >= DETAIL_COORD
+	size_t j;
 	float const* f;
-	float* q;
-	uint8_t map_mask;
+#endif
 
 #if LOGGING_LEVEL >= 4
 	PPLog(4, "%s:   s2 == %#x, s4 == %#x\n", __FUNCTION__,
 		  imm_s[2], imm_s[4] & 0x1FC4U);
 #endif
-#ifdef VECTORIZE
-	__asm__ volatile ("xorps %0, %0" "\n\t"
-					  "movlps %1, %0" : "=x"(xmm0) : "m"(const_halves[0]) );
-#endif
-	for (i = 0U, map_mask = map[8]; i != num_decls; ++i) {
+	/*
+	 * Barbarically assume at least FLOAT2 and adjust
+	 *   Note: The GLD always uses FLOAT4 projective tex-coords.
+	 */
+	for (i = 0U, plan.num_coords = 0U; i != num_decls; ++i) {
 		if (_decls[i].identity.usage != SVGA3D_DECLUSAGE_TEXCOORD ||
-			!bit_select(map_mask, _decls[i].identity.usageIndex, 1))
+			!bit_select(map[8], _decls[i].identity.usageIndex, 1))
 			continue;
-		f = m_float_cache + 4U * map[_decls[i].identity.usageIndex];
-		/*
-		 * Barbarically assume at least FLOAT2 and adjust
-		 *   Note: The GLD always uses FLOAT4 projective tex-coords.
-		 */
-#ifdef VECTORIZE
-		__asm__ volatile ("movaps %1, %0" : "=x"(xmm1) : "m"(*f) );
-#endif
-		for (j = 0U; j != num_vertices; ++j) {
-			q = reinterpret_cast<typeof q>(vertex_array + j * _decls[i].array.stride + _decls[i].array.offset);
-#if LOGGING_LEVEL >= DETAIL_COORD
-			PPLog(3, "%s:   adjusting X == %d, Y == %d, Z == %d, W == %d\n", __FUNCTION__,
-				  static_cast<int>(q[0]),
-				  static_cast<int>(q[1]),
-				  static_cast<int>(q[2] * 32767.0F),
-				  static_cast<int>(q[3] * 32767.0F));
-#endif
-#ifdef VECTORIZE
-			__asm__ volatile ("movlps %0, %1" "\n\t"
-							  "addps %3, %1" "\n\t"
-							  "mulps %2, %1" "\n\t"
-							  "movlps %1, %0" : "+m"(*q), "=x"(xmm2) : "x"(xmm1), "x"(xmm0) );
-#else
-			q[0] = (q[0] + 0.5F) * f[0];
-			q[1] = (q[1] + 0.5F) * f[1];
-#endif
-		}
+		plan.offset[plan.num_coords] = _decls[i].array.offset / sizeof(float);
+		plan.scale[plan.num_coords] = m_float_cache + 4U * map[_decls[i].identity.usageIndex];
+		++plan.num_coords;
 	}
+	if (!plan.num_coords || !num_decls)
+		return;
+	select_adjust_kernel(_decls[0].array.stride, plan.num_coords)(vertex_array,
+																  num_vertices,
+																  _decls[0].array.stride,
+																  &plan);
 #if LOGGING_LEVEL >= DETAIL_COORD
 	for (j = 0U; j != num_vertices; ++j) {
 		unsigned const* r = reinterpret_cast<unsigned const*>(vertex_array + j * _decls[1].array.stride + _decls[1].array.offset);
@@ -737,54 +1078,180 @@ bool CLASS::cache_misc_reg(uint8_t regnum, uint32_t value)
 	return true;
 }
 
+/*
+ * Sends only the render states that differ from those
+ *   last sent to the host.  Compacts states in place.
+ */
+HIDDEN
+void CLASS::set_render_state(uint32_t numStates, SVGA3dRenderState* states)
+{
+	uint32_t i, j, name;
+
+	for (i = 0U, j = 0U; i != numStates; ++i) {
+		name = states[i].state;
+		if (name < SVGA3D_RS_MAX) {
+			if (bit_select(rs_shadow_valid[name >> 5], name & 31U, 1) &&
+				rs_shadow[name] == states[i].uintValue)
+				continue;
+			rs_shadow[name] = states[i].uintValue;
+			rs_shadow_valid[name >> 5] |= (1U << (name & 31U));
+		}
+		if (j != i)
+			states[j] = states[i];
+		++j;
+	}
+	if (j)
+		m_provider->setRenderState(m_context_id, j, states);
+}
+
+/*
+ * Same as set_render_state, for texture stage states
+ */
+HIDDEN
+void CLASS::set_texture_state(uint32_t numStates, SVGA3dTextureState* states)
+{
+	uint32_t i, j, stage, name;
+
+	for (i = 0U, j = 0U; i != numStates; ++i) {
+		stage = states[i].stage;
+		name = states[i].name;
+		/*
+		 * Surface ids are reused as soon as textures are deleted
+		 *   or evicted, so an equal id may be a different surface.
+		 *   BIND_TEXTURE is always sent.
+		 */
+		if (stage < 16U && name < SVGA3D_TS_MAX &&
+			name != SVGA3D_TS_BIND_TEXTURE) {
+			if (bit_select(ts_shadow_valid[stage], name, 1) &&
+				ts_shadow[stage][name] == states[i].value)
+				continue;
+			ts_shadow[stage][name] = states[i].value;
+			ts_shadow_valid[stage] |= (1U << name);
+		}
+		if (j != i)
+			states[j] = states[i];
+		++j;
+	}
+	if (j)
+		m_provider->setTextureState(m_context_id, j, states);
+}
+
+/*
+ * Returns the vertex format for the current S2/S4, decoding
+ *   it only if not found in the cache
+ */
+HIDDEN
+CEsvga2IPP::VertexFormat const* CLASS::get_vertex_format(void)
+{
+	VertexFormat* vf;
+	uint32_t s2 = imm_s[2], s4 = imm_s[4] & VFMT_S4_MASK;
+	IOReturn rc;
+
+	if (m_vertex_format)
+		return m_vertex_format;
+	vf = &m_vertex_formats[(s2 ^ (s2 >> 16) ^ (s4 >> 6)) & (VERTEX_FORMAT_CACHE_SIZE - 1U)];
+	if (vf->num_decls &&
+		vf->s2 == s2 &&
+		vf->s4 == s4) {
+		m_vertex_format = vf;
+		return vf;
+	}
+	vf->num_decls = sizeof vf->decls / sizeof vf->decls[0];
+	rc = analyze_vertex_format(static_cast<int>(s2),
+							   s4,
+							   &vf->decls[0],
+							   &vf->num_decls);
+	if (rc != kIOReturnSuccess) {
+		PPLog(1, "%s: analyze_vertex_format return %#x\n", __FUNCTION__, rc);
+		vf->num_decls = 0U;
+		return 0;
+	}
+	if (!vf->num_decls || !vf->decls[0].array.stride) {
+		vf->num_decls = 0U;
+		return 0;	// nothing to do
+	}
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s:   num vertex decls == %lu\n", __FUNCTION__, vf->num_decls);
+#endif
+	vf->s2 = s2;
+	vf->s4 = s4;
+	m_vertex_format = vf;
+	return vf;
+}
+
+HIDDEN
+void CLASS::flush_batch(void)
+{
+	size_t i;
+	IOReturn rc;
+	uint32_t vertex_sid;
+
+	if (!m_batch.num_ranges)
+		return;
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s:   %lu ranges, %lu vertices, %lu bytes\n", __FUNCTION__,
+		  m_batch.num_ranges, m_batch.num_vertices, m_batch.vsize);
+#endif
+	rc = m_arrays.upload(m_provider, m_batch.vertex_ptr, m_batch.vsize, &vertex_sid);
+	if (rc != kIOReturnSuccess) {
+		PPLog(1, "%s: upload_arrays return %#x\n", __FUNCTION__, rc);
+		goto done;
+	}
+	for (i = 0U; i != m_batch.num_decls; ++i) {
+		m_batch.decls[i].array.surfaceId = vertex_sid;
+		m_batch.decls[i].rangeHint.last = static_cast<uint32_t>(m_batch.num_vertices);
+	}
+	rc = m_provider->drawPrimitives(m_context_id,
+									static_cast<uint32_t>(m_batch.num_decls),
+									static_cast<uint32_t>(m_batch.num_ranges),
+									&m_batch.decls[0],
+									&m_batch.ranges[0]);
+	if (rc != kIOReturnSuccess)
+		PPLog(1, "%s: drawPrimitives return %#x\n", __FUNCTION__, rc);
+done:
+	m_batch.num_ranges = 0U;
+}
+
+/*
+ * A flat shaded polygon can't go through the batch as a fan,
+ *   so it's drawn on its own as an indexed triangle list
+ */
 HIDDEN
-void CLASS::ip_prim3d_poly(uint32_t const* vertex_data, size_t num_vertex_dwords)
+void CLASS::ip_prim3d_flat_poly(uint32_t const* vertex_data, size_t num_vertex_dwords)
 {
 	size_t i, num_decls, num_vertices, vsize, isize;
 	uint8_t* vertex_ptr;
 	IOReturn rc;
 	uint32_t vertex_sid;
 	uint8_t adjustment_map[9];
+	VertexFormat const* vf;
 	SVGA3dVertexDecl decls[MAX_NUM_DECLS];
 	SVGA3dPrimitiveRange range;
 
 	if (!num_vertex_dwords || !vertex_data)
 		return; // nothing to do
-	num_decls = sizeof decls / sizeof decls[0];
-	rc = analyze_vertex_format(imm_s[2],
-							   imm_s[4],
-							   &decls[0],
-							   &num_decls);
-	if (rc != kIOReturnSuccess) {
-		PPLog(1, "%s: analyze_vertex_format return %#x\n", __FUNCTION__, rc);
+	vf = get_vertex_format();
+	if (!vf)
 		return;
-	}
-	if (!num_decls || !decls[0].array.stride)
-		return;	// nothing to do
-#if LOGGING_LEVEL >= 4
-	PPLog(4, "%s:   num vertex decls == %lu\n", __FUNCTION__, num_decls);
-#endif
+	num_decls = vf->num_decls;
+	memcpy(&decls[0], &vf->decls[0], num_decls * sizeof decls[0]);
 	vsize = num_vertex_dwords * sizeof(uint32_t);
 	num_vertices = vsize / decls[0].array.stride;
 	if (num_vertices < 3U)
 		return; // nothing to do
-	isize = num_vertices * sizeof(uint16_t);
+	vsize = num_vertices * decls[0].array.stride;
+	isize = 3U * (num_vertices - 2U) * sizeof(uint16_t);
+	flush_batch();
 	rc = m_arrays.alloc(m_provider, vsize + isize, &vertex_ptr);
 	if (rc != kIOReturnSuccess) {
 		PPLog(1, "%s: alloc_arrays return %#x\n", __FUNCTION__, rc);
 		return;
 	}
 	memcpy(vertex_ptr, vertex_data, vsize);
-#if LOGGING_LEVEL >= 4
-	PPLog(4, "%s:   vertex_size == %u, num_vertices == %lu, copied %lu bytes\n",__FUNCTION__,
-		  decls[0].array.stride, num_vertices, vsize);
-#endif
-	/*
-	 * Prepare Index Array for a polygon
-	 */
-	make_polygon_index_array(reinterpret_cast<uint16_t*>(vertex_ptr + vsize),
-							 0U,
-							 static_cast<uint16_t>(num_vertices));
+	make_flat_polygon_index_array(reinterpret_cast<uint16_t*>(vertex_ptr + vsize),
+								  0,
+								  0U,
+								  num_vertices);
 	calc_adjustment_map(&adjustment_map[0]);
 	if (adjustment_map[8])
 		adjust_texture_coords(&adjustment_map[0],
@@ -792,25 +1259,21 @@ void CLASS::ip_prim3d_poly(uint32_t const* vertex_data, size_t num_vertex_dwords
 							  num_vertices,
 							  &decls[0],
 							  num_decls);
-	if (imm_s[4] & (1U << 15))
-		flatshade_polygon(vertex_ptr,
-						  num_vertices,
-						  &decls[0],
-						  num_decls);
 	rc = m_arrays.upload(m_provider, vertex_ptr, vsize + isize, &vertex_sid);
 	if (rc != kIOReturnSuccess) {
 		PPLog(1, "%s: upload_arrays return %#x\n", __FUNCTION__, rc);
 		return;
 	}
-	range.primType = SVGA3D_PRIMITIVE_TRIANGLESTRIP;
+	range.primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
 	range.primitiveCount = static_cast<uint32_t>(num_vertices - 2U);
 	range.indexArray.surfaceId = vertex_sid;
 	range.indexArray.offset = static_cast<uint32_t>(vsize);
 	range.indexArray.stride = sizeof(uint16_t);
 	range.indexWidth = sizeof(uint16_t);
-	range.indexBias = 0U;
+	range.indexBias = 0;
 	for (i = 0U; i != num_decls; ++i) {
 		decls[i].array.surfaceId = vertex_sid;
+		decls[i].rangeHint.first = 0U;
 		decls[i].rangeHint.last = static_cast<uint32_t>(num_vertices);
 	}
 	rc = m_provider->drawPrimitives(m_context_id,
@@ -825,78 +1288,73 @@ void CLASS::ip_prim3d_poly(uint32_t const* vertex_data, size_t num_vertex_dwords
 HIDDEN
 void CLASS::ip_prim3d_direct(uint32_t prim_kind, uint32_t const* vertex_data, size_t num_vertex_dwords)
 {
-	size_t i, num_decls, num_vertices, vsize;
+	size_t num_decls, num_vertices, num_rects, vsize;
 	uint8_t* vertex_ptr;
 	IOReturn rc;
-	uint32_t vertex_sid;
 	uint8_t adjustment_map[9];
-	SVGA3dVertexDecl decls[MAX_NUM_DECLS];
+	VertexFormat const* vf;
+	SVGA3dVertexDecl const* decls;
 	SVGA3dPrimitiveRange range;
 
 	if (!num_vertex_dwords || !vertex_data)
 		return; // nothing to do
-	num_decls = sizeof decls / sizeof decls[0];
-	rc = analyze_vertex_format(imm_s[2],
-							   imm_s[4],
-							   &decls[0],
-							   &num_decls);
-	if (rc != kIOReturnSuccess) {
-		PPLog(1, "%s: analyze_vertex_format return %#x\n", __FUNCTION__, rc);
+	vf = get_vertex_format();
+	if (!vf)
 		return;
-	}
-	if (!num_decls || !decls[0].array.stride)
-		return;	// nothing to do
-#if LOGGING_LEVEL >= 4
-	PPLog(4, "%s:   num vertex decls == %lu\n", __FUNCTION__, num_decls);
-#endif
+	num_decls = vf->num_decls;
+	decls = &vf->decls[0];
 	vsize = num_vertex_dwords * sizeof(uint32_t);
 	num_vertices = vsize / decls[0].array.stride;
+	if (!set_primitive_range(prim_kind, num_vertices, &range))
+		return;	// nothing to do
+	num_rects = 0U;
 	switch (prim_kind) {
-		case 0: /* PRIM3D_TRILIST */
-			if (num_vertices < 3U)
-				return; // nothing to do
-			range.primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
-			range.primitiveCount = static_cast<uint32_t>(num_vertices / 3U);
+		case 2: /* PRIM3D_TRISTRIP_RVRSE */
+			++num_vertices;	// first vertex doubled
 			break;
-		case 1: /* PRIM3D_TRISTRIP */
-			if (num_vertices < 3U)
-				return; // nothing to do
-			range.primType = SVGA3D_PRIMITIVE_TRIANGLESTRIP;
-			range.primitiveCount = static_cast<uint32_t>(num_vertices - 2U);
-			break;
-		case 3: /* PRIM3D_TRIFAN */
-			if (num_vertices < 3U)
-				return; // nothing to do
-			range.primType = SVGA3D_PRIMITIVE_TRIANGLEFAN;
-			range.primitiveCount = static_cast<uint32_t>(num_vertices - 2U);
-			break;
-		case 5: /* PRIM3D_LINELIST */
-			if (num_vertices < 2U)
-				return; // nothing to do
-			range.primType = SVGA3D_PRIMITIVE_LINELIST;
-			range.primitiveCount = static_cast<uint32_t>(num_vertices >> 1);
-			break;
-		case 6: /* PRIM3D_LINESTRIP */
-			if (num_vertices < 2U)
-				return; // nothing to do
-			range.primType = SVGA3D_PRIMITIVE_LINESTRIP;
-			range.primitiveCount = static_cast<uint32_t>(num_vertices - 1U);
-			break;
-		case 8: /* PRIM3D_POINTLIST */
-			if (!num_vertices)
-				return; // nothing to do
-			range.primType = SVGA3D_PRIMITIVE_POINTLIST;
-			range.primitiveCount = static_cast<uint32_t>(num_vertices);
+		case 7: /* PRIM3D_RECTLIST */
+			num_rects = num_vertices / 3U;
+			num_vertices = num_rects * 6U;
 			break;
-		default:
-			return;	// error, shouldn't get here
 	}
+	/*
+	 * Only whole vertices go into the batch, so that
+	 *   each range starts on a vertex boundary
+	 */
+	vsize = num_vertices * decls[0].array.stride;
+	if (m_batch.num_ranges &&
+		(m_batch.num_ranges == SVGA3D_MAX_DRAW_PRIMITIVE_RANGES ||
+		 m_batch.s2 != imm_s[2] ||
+		 m_batch.s4 != imm_s[4] ||
+		 vsize > m_arrays.avail()))
+		flush_batch();
 	rc = m_arrays.alloc(m_provider, vsize, &vertex_ptr);
 	if (rc != kIOReturnSuccess) {
 		PPLog(1, "%s: alloc_arrays return %#x\n", __FUNCTION__, rc);
 		return;
 	}
-	memcpy(vertex_ptr, vertex_data, vsize);
+	switch (prim_kind) {
+		case 2: /* PRIM3D_TRISTRIP_RVRSE */
+			/*
+			 * A leading degenerate triangle flips the
+			 *   winding of every triangle that follows
+			 */
+			memcpy(vertex_ptr, vertex_data, decls[0].array.stride);
+			memcpy(vertex_ptr + decls[0].array.stride,
+				   vertex_data,
+				   vsize - decls[0].array.stride);
+			break;
+		case 7: /* PRIM3D_RECTLIST */
+			expand_rectlist(vertex_ptr,
+							reinterpret_cast<uint8_t const*>(vertex_data),
+							num_rects,
+							decls,
+							num_decls);
+			break;
+		default:
+			memcpy(vertex_ptr, vertex_data, vsize);
+			break;
+	}
 #if LOGGING_LEVEL >= 4
 	PPLog(4, "%s:   vertex_size == %u, num_vertices == %lu, copied %lu bytes\n",__FUNCTION__,
 		  decls[0].array.stride, num_vertices, vsize);
@@ -908,20 +1366,248 @@ void CLASS::ip_prim3d_direct(uint32_t prim_kind, uint32_t const* vertex_data, si
 							  num_vertices,
 							  &decls[0],
 							  num_decls);
-	rc = m_arrays.upload(m_provider, vertex_ptr, vsize, &vertex_sid);
+	if (!m_batch.num_ranges) {
+		m_batch.vertex_ptr = vertex_ptr;
+		m_batch.vsize = 0U;
+		m_batch.num_vertices = 0U;
+		m_batch.num_decls = num_decls;
+		m_batch.s2 = imm_s[2];
+		m_batch.s4 = imm_s[4];
+		memcpy(&m_batch.decls[0], &decls[0], num_decls * sizeof decls[0]);
+	}
+	/*
+	 * Non-indexed range, indexBias is the first vertex
+	 */
+	range.indexArray.surfaceId = SVGA_ID_INVALID;
+	range.indexArray.offset = 0U;
+	range.indexArray.stride = sizeof(uint16_t);
+	range.indexWidth = sizeof(uint16_t);
+	range.indexBias = static_cast<int32_t>(m_batch.num_vertices);
+	m_batch.ranges[m_batch.num_ranges++] = range;
+	m_batch.vsize += vsize;
+	m_batch.num_vertices += num_vertices;
+}
+
+/*
+ * Makes the first num_bytes of the vertex buffer's own surface
+ *   match the client's data.  Once per submission the client's
+ *   bytes are read and hashed, and they're only uploaded to the
+ *   host again if they differ from the last upload, or more are
+ *   needed.  The read is still proportional to the buffer; what's
+ *   saved is the host upload.
+ * Note: tx->vb_hash and tx->vb_valid_bytes are shared by all contexts
+ *   drawing from tx, and are guarded by tx->creator's shared lock.
+ *   All submissions are made with it held.
+ */
+HIDDEN
+IOReturn CLASS::sync_vertex_buffer(size_t num_bytes)
+{
+	CEsvga2TextureBuffer* tx = m_vb.tx;
+	size_t padded_bytes;
+	uint8_t* ptr;
+	uint64_t hash;
+	IOReturn rc;
+
+	if (m_vb.verified && num_bytes <= tx->vb_valid_bytes)
+		return kIOReturnSuccess;
+	/*
+	 * Whatever was drawn from so far must stay valid too
+	 */
+	if (num_bytes < tx->vb_valid_bytes)
+		num_bytes = tx->vb_valid_bytes;
+	padded_bytes = (num_bytes + 3U) & ~static_cast<size_t>(3U);
+	rc = m_vb_array.alloc(m_provider, padded_bytes, &ptr);
+	if (rc != kIOReturnSuccess)
+		return rc;
+	/*
+	 * The buffer's memory belongs to the client task, so it's
+	 *   read through the descriptor rather than dereferenced
+	 */
+	if (m_vb.md->readBytes(m_vb.offset, ptr, num_bytes) != num_bytes)
+		return kIOReturnUnderrun;
+	bzero(ptr + num_bytes, padded_bytes - num_bytes);
+	hash = hash_dwords(reinterpret_cast<uint32_t const*>(ptr), static_cast<uint32_t>(padded_bytes >> 2));
+	if (num_bytes == tx->vb_valid_bytes && hash == tx->vb_hash) {
+		m_vb.verified = true;
+		return kIOReturnSuccess;
+	}
+	rc = m_vb_array.upload_to(m_provider, ptr, num_bytes, tx->surface_id);
+	if (rc != kIOReturnSuccess)
+		return rc;
+	tx->vb_hash = hash;
+	tx->vb_valid_bytes = static_cast<uint32_t>(num_bytes);
+	m_vb.verified = true;
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s:   uploaded %lu bytes to sid %u\n", __FUNCTION__, num_bytes, tx->surface_id);
+#endif
+	return kIOReturnSuccess;
+}
+
+/*
+ * Makes the first num_vertices of the client vertex buffer
+ *   available on the host, in m_vb.sid.  Adjusted copies
+ *   go through m_vb_array, as does everything if the buffer
+ *   has no surface of its own.
+ */
+HIDDEN
+IOReturn CLASS::upload_vertex_buffer(size_t vertex_offset,
+									 size_t num_vertices,
+									 SVGA3dVertexDecl const* decls,
+									 size_t num_decls)
+{
+	size_t num_bytes;
+	uint8_t* ptr;
+	IOReturn rc;
+	uint8_t adjustment_map[9];
+
+	if (!m_vb.md)
+		return kIOReturnNotReady;
+	num_bytes = vertex_offset + num_vertices * decls[0].array.stride;
+	if (num_bytes > m_vb.size)
+		return kIOReturnOverrun;
+	calc_adjustment_map(&adjustment_map[0]);
+	if (!adjustment_map[8] && m_vb.tx && isIdValid(m_vb.tx->surface_id)) {
+		rc = sync_vertex_buffer(num_bytes);
+		if (rc == kIOReturnSuccess) {
+			m_vb.sid = m_vb.tx->surface_id;
+			m_vb.uploaded_bytes = 0U;
+			return rc;
+		}
+		PPLog(1, "%s: sync_vertex_buffer return %#x\n", __FUNCTION__, rc);
+	}
+	if (num_bytes <= m_vb.uploaded_bytes && !adjustment_map[8])
+		return kIOReturnSuccess;
+	rc = m_vb_array.alloc(m_provider, num_bytes, &ptr);
+	if (rc != kIOReturnSuccess)
+		return rc;
+	if (m_vb.md->readBytes(m_vb.offset, ptr, num_bytes) != num_bytes)
+		return kIOReturnUnderrun;
+	if (adjustment_map[8])
+		adjust_texture_coords(&adjustment_map[0],
+							  ptr + vertex_offset,
+							  num_vertices,
+							  decls,
+							  num_decls);
+	rc = m_vb_array.upload(m_provider, ptr, num_bytes, &m_vb.sid);
+	if (rc != kIOReturnSuccess)
+		return rc;
+	/*
+	 * An adjusted copy depends on sampler state, so don't reuse it
+	 */
+	m_vb.uploaded_bytes = adjustment_map[8] ? 0U : num_bytes;
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s:   uploaded %lu bytes\n", __FUNCTION__, num_bytes);
+#endif
+	return kIOReturnSuccess;
+}
+
+/*
+ * Draws vertices from the client vertex buffer, either the
+ *   list of indices given or num_indices sequential from start
+ */
+HIDDEN
+void CLASS::ip_prim3d_indirect(uint32_t prim_kind, uint16_t const* indices, size_t num_indices, uint32_t start)
+{
+	size_t i, num_decls, isize, vertex_offset;
+	uint32_t min_index, max_index, pitch, index_sid;
+	uint16_t* index_ptr;
+	IOReturn rc;
+	VertexFormat const* vf;
+	SVGA3dVertexDecl decls[MAX_NUM_DECLS];
+	SVGA3dPrimitiveRange range;
+	bool flat_poly;
+
+	if (!num_indices)
+		return;	// nothing to do
+	if (!m_vb.md) {
+		PPLog(1, "%s: no vertex buffer\n", __FUNCTION__);
+		return;
+	}
+	vf = get_vertex_format();
+	if (!vf)
+		return;
+	num_decls = vf->num_decls;
+	memcpy(&decls[0], &vf->decls[0], num_decls * sizeof decls[0]);
+	/*
+	 * S1 gives the vertex pitch in dwords, S0 the address
+	 */
+	pitch = bit_select(imm_s[1], 16, 6) * static_cast<uint32_t>(sizeof(uint32_t));
+	if (pitch)
+		for (i = 0U; i != num_decls; ++i)
+			decls[i].array.stride = pitch;
+	vertex_offset = (imm_s[0] & ~3U) - m_vb.address;
+	if (vertex_offset >= m_vb.size) {
+		PPLog(1, "%s: vertex buffer address %#x out of range\n", __FUNCTION__, imm_s[0]);
+		return;
+	}
+	if (indices) {
+		min_index = 0xFFFFU;
+		max_index = 0U;
+		for (i = 0U; i != num_indices; ++i) {
+			if (indices[i] < min_index)
+				min_index = indices[i];
+			if (indices[i] > max_index)
+				max_index = indices[i];
+		}
+	} else {
+		min_index = start;
+		max_index = start + static_cast<uint32_t>(num_indices) - 1U;
+	}
+	if (!set_primitive_range(prim_kind, num_indices, &range))
+		return;	// nothing to do
+	flat_poly = prim_kind == 4U /* PRIM3D_POLY */ && (imm_s[4] & (1U << 15));
+	if (flat_poly)
+		range.primType = SVGA3D_PRIMITIVE_TRIANGLELIST;
+	flush_batch();
+	rc = upload_vertex_buffer(vertex_offset,
+							  max_index + 1U,
+							  &decls[0],
+							  num_decls);
 	if (rc != kIOReturnSuccess) {
-		PPLog(1, "%s: upload_arrays return %#x\n", __FUNCTION__, rc);
+		PPLog(1, "%s: upload_vertex_buffer return %#x\n", __FUNCTION__, rc);
 		return;
 	}
-	range.indexArray.surfaceId = SVGA_ID_INVALID;
+	if (indices || flat_poly) {
+		isize = (flat_poly ? 3U * (num_indices - 2U) : num_indices) * sizeof(uint16_t);
+		rc = m_index_array.alloc(m_provider, isize, reinterpret_cast<uint8_t**>(&index_ptr));
+		if (rc != kIOReturnSuccess) {
+			PPLog(1, "%s: alloc_arrays return %#x\n", __FUNCTION__, rc);
+			return;
+		}
+		if (flat_poly)
+			make_flat_polygon_index_array(index_ptr,
+										  indices,
+										  static_cast<uint16_t>(start),
+										  num_indices);
+		else
+			memcpy(index_ptr, indices, isize);
+		rc = m_index_array.upload(m_provider, reinterpret_cast<uint8_t*>(index_ptr), isize, &index_sid);
+		if (rc != kIOReturnSuccess) {
+			PPLog(1, "%s: upload_arrays return %#x\n", __FUNCTION__, rc);
+			return;
+		}
+		range.indexArray.surfaceId = index_sid;
+		range.indexBias = 0;
+	} else {
+		/*
+		 * Non-indexed range, indexBias is the first vertex
+		 */
+		range.indexArray.surfaceId = SVGA_ID_INVALID;
+		range.indexBias = static_cast<int32_t>(start);
+	}
 	range.indexArray.offset = 0U;
 	range.indexArray.stride = sizeof(uint16_t);
 	range.indexWidth = sizeof(uint16_t);
-	range.indexBias = 0U;
 	for (i = 0U; i != num_decls; ++i) {
-		decls[i].array.surfaceId = vertex_sid;
-		decls[i].rangeHint.last = static_cast<uint32_t>(num_vertices);
+		decls[i].array.surfaceId = m_vb.sid;
+		decls[i].array.offset += static_cast<uint32_t>(vertex_offset);
+		decls[i].rangeHint.first = min_index;
+		decls[i].rangeHint.last = max_index + 1U;
 	}
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s:   primkind == %u, %lu indices, vertices %u - %u\n", __FUNCTION__,
+		  prim_kind, num_indices, min_index, max_index);
+#endif
 	rc = m_provider->drawPrimitives(m_context_id,
 									static_cast<uint32_t>(num_decls),
 									1U,
@@ -936,21 +1622,51 @@ uint32_t CLASS::ip_prim3d(uint32_t* p, uint32_t cmd)
 {
 	DefineRegion<1U> tmpRegion;
 	uint32_t skip = (cmd & 0xFFFFU) + 2U, primkind = bit_select(cmd, 18, 5);
+	uint32_t num_indices, clear_mask;
 	float const* pf;
 
 	if (cmd & (1U << 23)) {
-		PPLog(1, "%s: indirect primitive\n", __FUNCTION__);
+		/*
+		 * Indirect Primitive
+		 */
 		if (cmd & (1U << 17)) {
-			skip = cmd & 0xFFFFU;
+			num_indices = cmd & 0xFFFFU;
+			skip = num_indices;
 			if (!skip) {	// variable length, look for 0xFFFFU terminator
 				uint16_t const* q = reinterpret_cast<typeof q>(&p[1]);
 				for (skip = 0U; q[skip++] != 0xFFFFU;);
+				num_indices = skip - 1U;
 			}
 			// skip == number of uint16s
 			skip = (skip + 1U) / 2U + 1U;
-		} else
+		} else {
+			num_indices = cmd & 0xFFFFU;
 			skip = 2U;
-		return skip;	// Indirect Primitive, not handled
+		}
+		switch (primkind) {
+			case 0: /* PRIM3D_TRILIST */
+			case 1: /* PRIM3D_TRISTRIP */
+			case 3: /* PRIM3D_TRIFAN */
+			case 4: /* PRIM3D_POLY */
+			case 5: /* PRIM3D_LINELIST */
+			case 6: /* PRIM3D_LINESTRIP */
+			case 8: /* PRIM3D_POINTLIST */
+				if (cmd & (1U << 17))
+					ip_prim3d_indirect(primkind,
+									   reinterpret_cast<uint16_t const*>(&p[1]),
+									   num_indices,
+									   0U);
+				else
+					ip_prim3d_indirect(primkind,
+									   0,
+									   num_indices,
+									   p[1] & 0xFFFFU);
+				break;
+			default:
+				PPLog(1, "%s:   indirect primkind == %u Unsupported\n", __FUNCTION__, primkind);
+				break;
+		}
+		return skip;
 	}
 	/*
 	 * Direct Primitive
@@ -969,18 +1685,29 @@ uint32_t CLASS::ip_prim3d(uint32_t* p, uint32_t cmd)
 	switch (primkind) {
 		case 0: /* PRIM3D_TRILIST */
 		case 1: /* PRIM3D_TRISTRIP */
+		case 2: /* PRIM3D_TRISTRIP_RVRSE */
 		case 3: /* PRIM3D_TRIFAN */
 		case 5: /* PRIM3D_LINELIST */
 		case 6: /* PRIM3D_LINESTRIP */
+		case 7: /* PRIM3D_RECTLIST */
 		case 8: /* PRIM3D_POINTLIST */
 			ip_prim3d_direct(primkind, &p[1], skip -1U);
 			break;
 		case 4: /* PRIM3D_POLY */
-			ip_prim3d_poly(&p[1], skip - 1U);
+			if (imm_s[4] & (1U << 15))	/* S4_FLATSHADE_COLOR */
+				ip_prim3d_flat_poly(&p[1], skip - 1U);
+			else
+				ip_prim3d_direct(primkind, &p[1], skip - 1U);
 			break;
 		case 10: /* PRIM3D_CLEAR_RECT */
-			if (!(clear_params.mask & 7U))
+		case 13: /* PRIM3D_ZONE_INIT */
+			/*
+			 * ZONE_INIT only initializes depth and stencil
+			 */
+			clear_mask = clear_params.mask & (primkind == 13U ? 3U : 7U);
+			if (!clear_mask)
 				break;	// nothing to do
+			flush_batch();
 			pf = reinterpret_cast<float const*>(p + 1);
 			set_region(&tmpRegion.r,
 					   static_cast<uint32_t>(pf[4]),
@@ -994,19 +1721,16 @@ uint32_t CLASS::ip_prim3d(uint32_t* p, uint32_t cmd)
 				  static_cast<int>(tmpRegion.r.bounds.y),
 				  static_cast<int>(tmpRegion.r.bounds.w),
 				  static_cast<int>(tmpRegion.r.bounds.h),
-				  translate_clear_mask(clear.mask));
+				  translate_clear_mask(clear_mask));
 #endif
 			m_provider->clear(m_context_id,
-							  SVGA3dClearFlag(translate_clear_mask(clear_params.mask)),
+							  SVGA3dClearFlag(translate_clear_mask(clear_mask)),
 							  &tmpRegion.r,
 							  clear_params.color,
 							  clear_params.depth,
 							  clear_params.stencil);
 			break;
-		case 2: /* PRIM3D_TRISTRIP_RVRSE */
-		case 7: /* PRIM3D_RECTLIST */
 		case 9: /* PRIM3D_DIB */
-		case 13: /* PRIM3D_ZONE_INIT */
 			PPLog(1, "%s:   primkind == %u Unsupported\n", __FUNCTION__, primkind);
 			break;
 	}
@@ -1041,9 +1765,12 @@ uint32_t CLASS::ip_load_immediate(uint32_t* p, uint32_t cmd)
 			}
 			switch (i) {
 				case 2U:
+					m_vertex_format = 0;
+					break;
 				case 3U:
 					break;
 				case 4U:
+					m_vertex_format = 0;
 #if LOGGING_LEVEL >= 4
 					PPLog(4, "%s: imm4 - PW %u, LW %u, FS %#x, CM %u, "
 						  "FDD %u, FDS %u, LDO %u, SP %u, LA %u\n", __FUNCTION__,
@@ -1067,7 +1794,7 @@ uint32_t CLASS::ip_load_immediate(uint32_t* p, uint32_t cmd)
 					rs[3].uintValue = bit_select(imm_s[i], 1, 1);
 					rs[4].state = SVGA3D_RS_ANTIALIASEDLINEENABLE;
 					rs[4].uintValue = bit_select(imm_s[i], 0, 1);
-					m_provider->setRenderState(m_context_id, 5U, &rs[0]);
+					set_render_state(5U, &rs[0]);
 					break;
 				case 5U:
 #if LOGGING_LEVEL >= 4
@@ -1108,7 +1835,7 @@ uint32_t CLASS::ip_load_immediate(uint32_t* p, uint32_t cmd)
 					rs[7].uintValue = xlate_stencilop(bit_select(imm_s[i], 4, 3));
 					rs[8].state = SVGA3D_RS_STENCILENABLE;
 					rs[8].uintValue = bit_select(imm_s[i],  3, 1);
-					m_provider->setRenderState(m_context_id, 9U, &rs[0]);
+					set_render_state(9U, &rs[0]);
 					break;
 				case 6U:
 #if LOGGING_LEVEL >= 4
@@ -1152,7 +1879,7 @@ uint32_t CLASS::ip_load_immediate(uint32_t* p, uint32_t cmd)
 					/*
 					 * Note: Direct3D doesn't seem to have Tristrip Provoking Vertex control
 					 */
-					m_provider->setRenderState(m_context_id, 11U, &rs[0]);
+					set_render_state(11U, &rs[0]);
 					break;
 				case 7U:
 #if LOGGING_LEVEL >= 4
@@ -1165,7 +1892,7 @@ uint32_t CLASS::ip_load_immediate(uint32_t* p, uint32_t cmd)
 						rs[0].uintValue = imm_s[i];	// Note: this is in fact a float
 					else
 						rs[0].floatValue = 0.0F;
-					m_provider->setRenderState(m_context_id, 1U, &rs[0]);
+					set_render_state(1U, &rs[0]);
 					break;
 				default:
 #if LOGGING_LEVEL >= 3
@@ -1340,7 +2067,7 @@ void CLASS::ip_3d_sampler_state(uint32_t* p)
 			/*
 			 * TBD: handle base mip level, min lod, lod bias
 			 */
-			m_provider->setTextureState(m_context_id, num_states, &ts[0]);
+			set_texture_state(num_states, &ts[0]);
 			q += 3;
 		}
 }
@@ -1362,7 +2089,7 @@ void CLASS::ip_misc_render_state(uint32_t selector, uint32_t* p)
 #endif
 			rs[0].state = SVGA3D_RS_SLOPESCALEDEPTHBIAS;
 			rs[0].uintValue = p[1];	// Note: this is in fact a float
-			m_provider->setRenderState(m_context_id, 1U, &rs[0]);
+			set_render_state(1U, &rs[0]);
 			break;
 		case 1U:
 #if LOGGING_LEVEL >= 4
@@ -1370,7 +2097,7 @@ void CLASS::ip_misc_render_state(uint32_t selector, uint32_t* p)
 #endif
 			rs[0].state = SVGA3D_RS_SCISSORTESTENABLE;
 			rs[0].uintValue = bit_select(p[0], 0, 1);
-			m_provider->setRenderState(m_context_id, 1U, &rs[0]);
+			set_render_state(1U, &rs[0]);
 			break;
 		case 2U:
 #if LOGGING_LEVEL >= 4
@@ -1396,7 +2123,7 @@ void CLASS::ip_misc_render_state(uint32_t selector, uint32_t* p)
 #endif
 			rs[0].state = SVGA3D_RS_BLENDCOLOR;
 			rs[0].uintValue = p[1];
-			m_provider->setRenderState(m_context_id, 1U, &rs[0]);
+			set_render_state(1U, &rs[0]);
 			break;
 		case 4U: /* 3DSTATE_MODES_4_CMD */
 #if LOGGING_LEVEL >= 4
@@ -1412,7 +2139,7 @@ void CLASS::ip_misc_render_state(uint32_t selector, uint32_t* p)
 			rs[0].uintValue = bit_select(p[0], 17, 1) ? bit_select(p[0], 8, 8) : 0xFFFFFFFFU;
 			rs[1].state = SVGA3D_RS_STENCILWRITEMASK;
 			rs[1].uintValue = bit_select(p[0], 16, 1) ? bit_select(p[0], 0, 8) : 0xFFFFFFFFU;
-			m_provider->setRenderState(m_context_id, 2U, &rs[0]);
+			set_render_state(2U, &rs[0]);
 			break;
 	}
 }
@@ -1451,7 +2178,7 @@ void CLASS::ip_independent_alpha_blend(uint32_t cmd)
 		rs[i++].uintValue = bit_select(cmd, 0, 4) + 1U;
 	}
 	if (i)
-		m_provider->setRenderState(m_context_id, i, &rs[0]);
+		set_render_state(i, &rs[0]);
 }
 
 HIDDEN
@@ -1486,7 +2213,7 @@ void CLASS::ip_backface_stencil_ops(uint32_t cmd)
 		rs[i++].uintValue = xlate_stencilop(bit_select(cmd, 2, 3));
 	}
 	if (i)
-		m_provider->setRenderState(m_context_id, i, &rs[0]);
+		set_render_state(i, &rs[0]);
 }
 
 #ifdef PRINT_PS
@@ -1560,16 +2287,36 @@ void CLASS::ip_print_ps(uint32_t const* p, uint32_t num_dwords)
 HIDDEN
 void CLASS::ip_select_and_load_ps(uint32_t* p, uint32_t cmd)
 {
+	ShaderEntry const* e;
+	uint32_t shader_id, s4;
+	SVGA3D* svga3d;
+
 	/*
-	 * Simplified shader support
+	 * Simplified shader support, unless translation is asked for.
+	 *   The translator's output hasn't been checked against all
+	 *   the canned shaders yet.
 	 */
-#if 1
-	uint32_t s4 = imm_s[4];
-	tc2s_map = TC2S_MAP_ID;
-	tc2s_map_valids = TC2S_MAP_ID_VALIDS;
-#else
-	ShaderEntry const* e = cache_shader(p + 1, (cmd & 0xFFFFU) + 1U);
-	uint32_t shader_id = (e ? e->shader_id : SVGA_ID_INVALID);
+	if (!checkOptionAC(CE1_OPTION_AC_GL_TRANSLATE_PS)) {
+		s4 = imm_s[4];
+		tc2s_map = TC2S_MAP_ID;
+		tc2s_map_valids = TC2S_MAP_ID_VALIDS;
+		if (s4 & (1U << 11))	/* S4_VFMT_SPEC_FOG */
+			shader_id = 3U;
+		else if ((imm_s[2] & 15U) != 15U) /* Tex1 + Diffuse */
+			shader_id = 2U;
+		else if (s4 & (1U << 10)) /* S4_VFMT_COLOR */
+			shader_id = 1U;
+		else
+			shader_id = SVGA_ID_INVALID;
+		svga3d = m_provider->lock3D();
+		if (!svga3d)
+			return;
+		svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, shader_id);
+		m_provider->unlock3D();
+		return;
+	}
+	e = cache_shader(p + 1, (cmd & 0xFFFFU) + 1U);
+	shader_id = (e ? e->shader_id : SVGA_ID_INVALID);
 	if (shader_id == m_active_shid)
 		return;
 	if (e) {
@@ -1579,20 +2326,9 @@ void CLASS::ip_select_and_load_ps(uint32_t* p, uint32_t cmd)
 		tc2s_map = TC2S_MAP_ID;
 		tc2s_map_valids = TC2S_MAP_ID_VALIDS;
 	}
-#endif
-	SVGA3D* svga3d = m_provider->lock3D();
+	svga3d = m_provider->lock3D();
 	if (!svga3d)
 		return;
-#if 1
-	if (s4 & (1U << 11))	/* S4_VFMT_SPEC_FOG */
-		svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, 3U);
-	else if ((imm_s[2] & 15U) != 15U) /* Tex1 + Diffuse */
-		svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, 2U);
-	else if (s4 & (1U << 10)) /* S4_VFMT_COLOR */
-		svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, 1U);
-	else
-		svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, SVGA_ID_INVALID);
-#else
 	svga3d->SetShader(m_context_id, SVGA3D_SHADERTYPE_PS, shader_id);
 	m_active_shid = shader_id;
 	if (!isIdValid(shader_id)) {
@@ -1617,9 +2353,10 @@ void CLASS::ip_select_and_load_ps(uint32_t* p, uint32_t cmd)
 			ts->name = SVGA3D_TS_TEXTURETRANSFORMFLAGS;
 			ts->value = SVGA3D_TEX_PROJECTED;
 			svga3d->FIFOCommitAll();
+			ts_shadow[0][SVGA3D_TS_TEXTURETRANSFORMFLAGS] = SVGA3D_TEX_PROJECTED;
+			ts_shadow_valid[0] |= (1U << SVGA3D_TS_TEXTURETRANSFORMFLAGS);
 		}
 	}
-#endif
 	m_provider->unlock3D();
 #if LOGGING_LEVEL >= DETAIL_COORD
 	PPLog(3, "%s: Loaded Shader %u\n", __FUNCTION__, shader_id);
@@ -1697,188 +2434,26 @@ void CLASS::ip_draw_rect(uint32_t* p)
 }
 
 HIDDEN
-uint32_t CLASS::decode_mi(uint32_t* p, uint32_t cmd)
+uint32_t CLASS::decode_unknown(uint32_t*, uint32_t cmd)
 {
-	uint32_t skip = 0U, fence_num;
-	SVGA3D* svga3d;
-	switch (bit_select(cmd, 23, 6)) {
-		case  0U: /* MI_NOOP */
-		case  2U: /* MI_USER_INTERRUPT */
-		case  3U: /* MI_WAIT_FOR_EVENT */
-		case  4U: /* MI_FLUSH */
-		case  7U: /* MI_REPORT_HEAD */
-		case  8U: /* MI_ARB_ON_OFF */
-		case 10U: /* MI_BATCH_BUFFER_END */
-			skip = 1U;
-			break;
-		case 20U: /* MI_DISPLAY_BUFFER_INFO */
-		case 34U: /* MI_LOAD_REGISTER_IMM */
-		case 36U: /* MI_STORE_REGISTER_MEM */
-		case 48U: /* MI_BATCH_BUFFER */
-			skip = 3U;
-			break;
-		case 17U: /* MI_OVERLAY_FLIP */
-		case 18U: /* MI_LOAD_SCAN_LINES_INCL */
-		case 19U: /* MI_LOAD_SCAN_LINES_EXCL */
-		case 24U: /* MI_SET_CONTEXT */
-		case 49U: /* MI_BATCH_BUFFER_START */
-			skip = 2U;
-			break;
-		case 32U: /* MI_STORE_DATA_IMM */
-			skip = (cmd & 0x3FU) + 2U;
-			break;
-		case 33U: /* MI_STORE_DATA_INDEX */
-			skip = (cmd & 0x3FU) + 2U;
-			if (p[1] != 64U)
-				break;
-			fence_num = p[2];
-			if (!m_fences_ptr ||
-				fence_num * sizeof(GLDFence) >= m_fences_len)
-				break;
-			svga3d = m_provider->lock3D();
-			if (!svga3d)
-				break;
-			m_fences_ptr[fence_num].u = svga3d->InsertFence();
-			m_fences_ptr[fence_num].v = 0U;
-			m_provider->unlock3D();
-#if LOGGING_LEVEL >= 4
-			PPLog(4, "%s: setting fence %u to %u\n", __FUNCTION__,
-				  fence_num, m_fences_ptr[fence_num].u);
-#endif
-			break;
-	}
-	return skip;
-}
-
-HIDDEN
-uint32_t CLASS::decode_2d(uint32_t* p, uint32_t cmd)
-{
-	uint32_t skip = 0U;
-	switch (bit_select(cmd, 22, 7)) {
-		case    1U: /* XY_SETUP_BLT */
-		case    3U: /* XY_SETUP_CLIP_BLT */
-		case 0x11U: /* XY_SETUP_MONO_PATTERN_SL_BLT */
-		case 0x24U: /* XY_PIXEL_BLT */
-		case 0x25U: /* XY_SCANLINES_BLT */
-		case 0x26U: /* Y_TEXT_BLT */
-		case 0x31U: /* XY_TEXT_IMMEDIATE_BLT */
-		case 0x40U: /* COLOR_BLT */
-		case 0x50U: /* XY_COLOR_BLT */
-		case 0x51U: /* XY_PAT_BLT */
-		case 0x52U: /* XY_MONO_PAT_BLT */
-		case 0x53U: /* XY_SRC_COPY_BLT */
-		case 0x54U: /* XY_MONO_SRC_COPY_BLT */
-		case 0x55U: /* XY_FULL_BLT */
-		case 0x56U: /* XY_FULL_MONO_SRC_BLT */
-		case 0x57U: /* XY_FULL_MONO_PATTERN_BLT */
-		case 0x58U: /* XY_FULL_MONO_PATTERN_MONO_SRC_BLT */
-		case 0x59U: /* XY_MONO_PAT_FIXED_BLT */
-		case 0x71U: /* XY_MONO_SRC_COPY_IMMEDIATE_BLT */
-		case 0x72U: /* XY_PAT_BLT_IMMEDIATE */
-		case 0x75U: /* XY_FULL_MONO_SRC_IMMEDIATE_PATTERN_BLT */
-		case 0x76U: /* XY_PAT_CHROMA_BLT */
-		case 0x77U: /* XY_PAT_CHROMA_BLT_IMMEDIATE */
-			skip = (cmd & 0xFFU) + 2U;
-			break;
-		case 0x43U: /* SRC_COPY_BLT */
-#if LOGGING_LEVEL >= 2
-			PPLog(3, "%s:   SRC_COPY_BLT\n", __FUNCTION__);
-#endif
-			skip = (cmd & 0xFFU) + 2U;
-			break;
-	}
-	return skip;
+	PPLog(1, "%s:   Unknown cmd %#x\n", __FUNCTION__, cmd);
+	return 0U;
 }
 
+/*
+ * Commands that are only logged
+ */
 HIDDEN
-uint32_t CLASS::decode_3d_1d(uint32_t* p, uint32_t cmd)
+uint32_t CLASS::decode_log_state(uint32_t* p, uint32_t cmd)
 {
-	uint32_t skip = (cmd & 0xFFFFU) + 2U;
-	switch (bit_select(cmd, 16, 8)) {
-		case 0x00U: /* 3DSTATE_MAP_STATE */
-			ip_3d_map_state(p);
-			break;
-		case 0x01U: /* 3DSTATE_SAMPLER_STATE */
-			ip_3d_sampler_state(p);
-			break;
-		case 0x04U: /* 3DSTATE_LOAD_STATE_IMMEDIATE_1 */
-			skip = ip_load_immediate(p, cmd);
-			break;
-		case 0x05U: /* 3DSTATE_PIXEL_SHADER_PROGRAM */
-			ip_select_and_load_ps(p, cmd);
-			break;
-		case 0x06U: /* 3DSTATE_PIXEL_SHADER_CONSTANTS */
-			ip_load_ps_const(p);
-			break;
-		case 0x80U: /* 3DSTATE_DRAW_RECT_CMD */
-			ip_draw_rect(p);
-			break;
-		case 0x81U: /* 3DSTATE_SCISSOR_RECT_0_CMD */
-			ip_misc_render_state(2U, p);
-			break;
-		case 0x83U: /* 3DSTATE_STIPPLE */
-#if LOGGING_LEVEL >= 4
-			PPLog(4, "%s: 3DSTATE_STIPPLE En %u, %#x\n", __FUNCTION__,
-				  bit_select(p[1], 16,  1),
-				  bit_select(p[1],  0, 16));
-#endif
-			break;
-		case 0x85U: /* 3DSTATE_DST_BUF_VARS_CMD */
-#if LOGGING_LEVEL >= 4
-			if (cache_misc_reg(5U, p[1])) {
-				PPLog(4, "%s: 3DSTATE_DST_BUF_VARS_CMD Upper %#x, DHB %u, DVB %u, "
-					  "YUV %u, COLOR %u, DEPTH %u, VLS %u\n", __FUNCTION__,
-					  bit_select(p[1], 24, 8),
-					  bit_select(p[1], 20, 4),
-					  bit_select(p[1], 16, 4),
-					  bit_select(p[1], 12, 3),
-					  bit_select(p[1],  8, 4),
-					  bit_select(p[1],  2, 2),
-					  bit_select(p[1],  0, 2));
-			}
-#endif
-			break;
-		case 0x88U: /* 3DSTATE_CONST_BLEND_COLOR_CMD */
-			ip_misc_render_state(3U, p);
-			break;
-		case 0x89U: /* 3DSTATE_FOG_MODE_CMD */
-#if LOGGING_LEVEL >= 3
-			PPLog(3, "%s: 3DSTATE_FOG_MODE_CMD FFMEn %u, FF %u, FIMEn %u, FI %u, "
-				  "C1C2MEn %u, DMEn %u, C1 %u, C2 %u, D1 %u\n", __FUNCTION__,
-				  bit_select(p[1], 31, 1),
-				  bit_select(p[1], 28, 2),
-				  bit_select(p[1], 27, 1),
-				  bit_select(p[1], 25, 1),
-				  bit_select(p[1], 24, 1),
-				  bit_select(p[1], 23, 1),
-				  bit_select(p[1],  4, 16),
-				  bit_select(p[2], 16, 1),
-				  bit_select(p[3], 16, 1));
-#endif
-			break;
-		case 0x8EU: /* 3DSTATE_BUF_INFO_CMD */
-			ip_buf_info(p);
-			break;
-		case 0x97U: /* 3DSTATE_DEPTH_OFFSET_SCALE */
-			ip_misc_render_state(0U, p);
-			break;
-		case 0x9CU: /* 3DSTATE_CLEAR_PARAMETERS */
-			skip = ip_clear_params(p, cmd);
-			break;
-		default:
-			PPLog(1, "%s:   Unknown cmd %#x\n", __FUNCTION__, cmd);
-			break;
+#if LOGGING_LEVEL >= 2
+	if ((cmd >> 29) == 2U) {
+		PPLog(3, "%s:   SRC_COPY_BLT\n", __FUNCTION__);
+		return 0U;
 	}
-	return skip;
-}
-
-HIDDEN
-uint32_t CLASS::decode_3d(uint32_t* p, uint32_t cmd)
-{
-	uint32_t skip = 0U;
 	switch (bit_select(cmd, 24, 5)) {
-		case 0x06U: /* 3DSTATE_AA_CMD */
 #if LOGGING_LEVEL >= 3
+		case 0x06U: /* 3DSTATE_AA_CMD */
 			if (cache_misc_reg(0U, cmd & 0xFFFFFFU)) {
 				PPLog(3, "%s: 3DSTATE_AA_CMD EWEn %u, EW %u, RWEn %u, RW %u\n", __FUNCTION__,
 					  bit_select(cmd, 16, 1),
@@ -1886,22 +2461,13 @@ uint32_t CLASS::decode_3d(uint32_t* p, uint32_t cmd)
 					  bit_select(cmd,  8, 1),
 					  bit_select(cmd,  6, 2));
 			}
-#endif
-			skip = 1U;
 			break;
+#endif
 		case 0x07U: /* 3DSTATE_RASTER_RULES_CMD */
-#if LOGGING_LEVEL >= 2
 			PPLog(3, "%s: 3DSTATE_RASTER_RULES_CMD %#x\n", __FUNCTION__, cmd & 0xFFFFFFU);
-#endif
-			skip = 1U;
 			break;
-		case 0x08U: /* 3DSTATE_BACKFACE_STENCIL_OPS */
-			if (cache_misc_reg(1U, cmd & 0xFFFFFFU))
-				ip_backface_stencil_ops(cmd);
-			skip = 1U;
-			break;
-		case 0x09U: /* 3DSTATE_BACKFACE_STENCIL_MASKS */
 #if LOGGING_LEVEL >= 4
+		case 0x09U: /* 3DSTATE_BACKFACE_STENCIL_MASKS */
 			if (cache_misc_reg(2U, cmd & 0xFFFFFFU)) {
 				PPLog(4, "%s: 3DSTATE_BACKFACE_STENCIL_MASKS STEn %u, SWEn %u, STM %u, SWM %u\n", __FUNCTION__,
 					  bit_select(cmd, 17, 1),
@@ -1909,57 +2475,343 @@ uint32_t CLASS::decode_3d(uint32_t* p, uint32_t cmd)
 					  bit_select(cmd,  8, 8),
 					  bit_select(cmd,  8, 8));
 			}
-#endif
-			skip = 1U;
-			break;
-		case 0x0BU: /* 3DSTATE_INDEPENDENT_ALPHA_BLEND_CMD */
-			if (cache_misc_reg(3U, cmd & 0xFFFFFFU))
-				ip_independent_alpha_blend(cmd);
-			skip = 1U;
 			break;
 		case 0x0CU: /* 3DSTATE_MODES_5_CMD */
-#if LOGGING_LEVEL >= 4
 			PPLog(4, "%s:   modes5 FRC %u, FTC %u\n", __FUNCTION__,
 				  bit_select(cmd, 18, 1),
 				  bit_select(cmd, 16, 1));
-#endif
-			skip = 1U;
-			break;
-		case 0x0DU: /* 3DSTATE_MODES_4_CMD */
-			if (cache_misc_reg(4U, cmd & 0xFFFFFFU))
-				ip_misc_render_state(4U, p);
-			skip = 1U;
 			break;
-		case 0x15U: /* 3DSTATE_FOG_COLOR_CMD */
+#endif
 #if LOGGING_LEVEL >= 3
+		case 0x15U: /* 3DSTATE_FOG_COLOR_CMD */
 			PPLog(3, "%s: 3DSTATE_FOG_COLOR_CMD %#x\n", __FUNCTION__, cmd & 0xFFFFFFU);
-#endif
-			skip = 1U;
 			break;
-		case 0x1CU:
+#endif
+		case 0x1DU:
 			switch (bit_select(cmd, 16, 8)) {
-				case 0x80U: /* 3DSTATE_SCISSOR_ENABLE */
-					ip_misc_render_state(1U, p);
-					skip = 1U;
+#if LOGGING_LEVEL >= 4
+				case 0x83U: /* 3DSTATE_STIPPLE */
+					PPLog(4, "%s: 3DSTATE_STIPPLE En %u, %#x\n", __FUNCTION__,
+						  bit_select(p[1], 16,  1),
+						  bit_select(p[1],  0, 16));
+					break;
+				case 0x85U: /* 3DSTATE_DST_BUF_VARS_CMD */
+					if (cache_misc_reg(5U, p[1])) {
+						PPLog(4, "%s: 3DSTATE_DST_BUF_VARS_CMD Upper %#x, DHB %u, DVB %u, "
+							  "YUV %u, COLOR %u, DEPTH %u, VLS %u\n", __FUNCTION__,
+							  bit_select(p[1], 24, 8),
+							  bit_select(p[1], 20, 4),
+							  bit_select(p[1], 16, 4),
+							  bit_select(p[1], 12, 3),
+							  bit_select(p[1],  8, 4),
+							  bit_select(p[1],  2, 2),
+							  bit_select(p[1],  0, 2));
+					}
 					break;
-				case 0x88U: /* 3DSTATE_DEPTH_SUBRECT_DISABLE */
-#if LOGGING_LEVEL >= 2
-					PPLog(3, "%s: 3DSTATE_DEPTH_SUBRECT_DISABLE %#x\n", __FUNCTION__, cmd & 0xFFFFFFU);
 #endif
-					skip = 1U;
+#if LOGGING_LEVEL >= 3
+				case 0x89U: /* 3DSTATE_FOG_MODE_CMD */
+					PPLog(3, "%s: 3DSTATE_FOG_MODE_CMD FFMEn %u, FF %u, FIMEn %u, FI %u, "
+						  "C1C2MEn %u, DMEn %u, C1 %u, C2 %u, D1 %u\n", __FUNCTION__,
+						  bit_select(p[1], 31, 1),
+						  bit_select(p[1], 28, 2),
+						  bit_select(p[1], 27, 1),
+						  bit_select(p[1], 25, 1),
+						  bit_select(p[1], 24, 1),
+						  bit_select(p[1], 23, 1),
+						  bit_select(p[1],  4, 16),
+						  bit_select(p[2], 16, 1),
+						  bit_select(p[3], 16, 1));
 					break;
+#endif
 			}
 			break;
-		case 0x1DU:
-			skip = decode_3d_1d(p, cmd);
-			break;
-		case 0x1FU: /* PRIM3D */
-			skip = ip_prim3d(p, cmd);
-			break;
+	}
+#endif
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_store_data_index(uint32_t* p, uint32_t)
+{
+	uint32_t fence_num;
+	SVGA3D* svga3d;
+
+	if (p[1] != 64U)
+		return 0U;
+	fence_num = p[2];
+	if (!m_fences_ptr ||
+		fence_num * sizeof(GLDFence) >= m_fences_len)
+		return 0U;
+	svga3d = m_provider->lock3D();
+	if (!svga3d)
+		return 0U;
+	m_fences_ptr[fence_num].u = svga3d->InsertFence();
+	m_fences_ptr[fence_num].v = 0U;
+	m_provider->unlock3D();
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s: setting fence %u to %u\n", __FUNCTION__,
+		  fence_num, m_fences_ptr[fence_num].u);
+#endif
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_map_state(uint32_t* p, uint32_t)
+{
+	ip_3d_map_state(p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_sampler_state(uint32_t* p, uint32_t)
+{
+	ip_3d_sampler_state(p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_pixel_shader_program(uint32_t* p, uint32_t cmd)
+{
+	ip_select_and_load_ps(p, cmd);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_pixel_shader_constants(uint32_t* p, uint32_t)
+{
+	ip_load_ps_const(p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_draw_rect(uint32_t* p, uint32_t)
+{
+	ip_draw_rect(p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_buf_info(uint32_t* p, uint32_t)
+{
+	ip_buf_info(p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_depth_offset_scale(uint32_t* p, uint32_t)
+{
+	ip_misc_render_state(0U, p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_scissor_rect(uint32_t* p, uint32_t)
+{
+	ip_misc_render_state(2U, p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_const_blend_color(uint32_t* p, uint32_t)
+{
+	ip_misc_render_state(3U, p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_backface_stencil_ops(uint32_t*, uint32_t cmd)
+{
+	if (cache_misc_reg(1U, cmd & 0xFFFFFFU))
+		ip_backface_stencil_ops(cmd);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_independent_alpha_blend(uint32_t*, uint32_t cmd)
+{
+	if (cache_misc_reg(3U, cmd & 0xFFFFFFU))
+		ip_independent_alpha_blend(cmd);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_modes_4(uint32_t* p, uint32_t cmd)
+{
+	if (cache_misc_reg(4U, cmd & 0xFFFFFFU))
+		ip_misc_render_state(4U, p);
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_3d_1c(uint32_t* p, uint32_t cmd)
+{
+	switch (bit_select(cmd, 16, 8)) {
+		case 0x80U: /* 3DSTATE_SCISSOR_ENABLE */
+			ip_misc_render_state(1U, p);
+			return 1U;
+		case 0x88U: /* 3DSTATE_DEPTH_SUBRECT_DISABLE */
+#if LOGGING_LEVEL >= 2
+			PPLog(3, "%s: 3DSTATE_DEPTH_SUBRECT_DISABLE %#x\n", __FUNCTION__, cmd & 0xFFFFFFU);
+#endif
+			return 1U;
+	}
+	return 0U;
+}
+
+HIDDEN
+uint32_t CLASS::decode_3d_1d(uint32_t* p, uint32_t cmd)
+{
+	return decode_entry(&decode_3d_1d_table[bit_select(cmd, 16, 8)], p, cmd);
+}
+
+/*
+ * Length of the command at p, after running its handler
+ */
+HIDDEN
+uint32_t CLASS::decode_entry(DecodeEntry const* entry, uint32_t* p, uint32_t cmd)
+{
+	uint32_t skip, r;
+
+	if (entry->length)
+		skip = entry->length;
+	else if (entry->length_mask)
+		skip = (cmd & entry->length_mask) + 2U;
+	else
+		skip = 0U;
+	if (entry->handler) {
+		r = (this->*entry->handler)(p, cmd);
+		if (r)
+			skip = r;
 	}
 	return skip;
 }
 
+#define DECODE_FIXED(op, len, handler) { op, { handler, len, 0U } }
+#define DECODE_VAR(op, mask, handler) { op, { handler, 0U, mask } }
+#define DECODE_SELF(op, handler) { op, { handler, 0U, 0U } }
+#if LOGGING_LEVEL >= 2
+#define LOG_STATE &CLASS::decode_log_state
+#else
+#define LOG_STATE 0
+#endif
+
+/*
+ * Expands the per-class opcode lists into the lookup tables.
+ *   The tables are shared by all contexts, so they're built
+ *   once, and any other context starting meanwhile waits.
+ */
+HIDDEN
+void CLASS::build_decode_tables(void)
+{
+	static DecodeOpcode const mi_opcodes[] =
+	{
+		DECODE_FIXED( 0U, 1U, 0),	/* MI_NOOP */
+		DECODE_FIXED( 2U, 1U, 0),	/* MI_USER_INTERRUPT */
+		DECODE_FIXED( 3U, 1U, 0),	/* MI_WAIT_FOR_EVENT */
+		DECODE_FIXED( 4U, 1U, 0),	/* MI_FLUSH */
+		DECODE_FIXED( 7U, 1U, 0),	/* MI_REPORT_HEAD */
+		DECODE_FIXED( 8U, 1U, 0),	/* MI_ARB_ON_OFF */
+		DECODE_FIXED(10U, 1U, 0),	/* MI_BATCH_BUFFER_END */
+		DECODE_FIXED(17U, 2U, 0),	/* MI_OVERLAY_FLIP */
+		DECODE_FIXED(18U, 2U, 0),	/* MI_LOAD_SCAN_LINES_INCL */
+		DECODE_FIXED(19U, 2U, 0),	/* MI_LOAD_SCAN_LINES_EXCL */
+		DECODE_FIXED(20U, 3U, 0),	/* MI_DISPLAY_BUFFER_INFO */
+		DECODE_FIXED(24U, 2U, 0),	/* MI_SET_CONTEXT */
+		DECODE_VAR(32U, 0x3FU, 0),	/* MI_STORE_DATA_IMM */
+		DECODE_VAR(33U, 0x3FU, &CLASS::decode_store_data_index),	/* MI_STORE_DATA_INDEX */
+		DECODE_FIXED(34U, 3U, 0),	/* MI_LOAD_REGISTER_IMM */
+		DECODE_FIXED(36U, 3U, 0),	/* MI_STORE_REGISTER_MEM */
+		DECODE_FIXED(48U, 3U, 0),	/* MI_BATCH_BUFFER */
+		DECODE_FIXED(49U, 2U, 0),	/* MI_BATCH_BUFFER_START */
+	};
+	static DecodeOpcode const blt_opcodes[] =
+	{
+		DECODE_VAR(0x01U, 0xFFU, 0),	/* XY_SETUP_BLT */
+		DECODE_VAR(0x03U, 0xFFU, 0),	/* XY_SETUP_CLIP_BLT */
+		DECODE_VAR(0x11U, 0xFFU, 0),	/* XY_SETUP_MONO_PATTERN_SL_BLT */
+		DECODE_VAR(0x24U, 0xFFU, 0),	/* XY_PIXEL_BLT */
+		DECODE_VAR(0x25U, 0xFFU, 0),	/* XY_SCANLINES_BLT */
+		DECODE_VAR(0x26U, 0xFFU, 0),	/* Y_TEXT_BLT */
+		DECODE_VAR(0x31U, 0xFFU, 0),	/* XY_TEXT_IMMEDIATE_BLT */
+		DECODE_VAR(0x40U, 0xFFU, 0),	/* COLOR_BLT */
+		DECODE_VAR(0x43U, 0xFFU, LOG_STATE),	/* SRC_COPY_BLT */
+		DECODE_VAR(0x50U, 0xFFU, 0),	/* XY_COLOR_BLT */
+		DECODE_VAR(0x51U, 0xFFU, 0),	/* XY_PAT_BLT */
+		DECODE_VAR(0x52U, 0xFFU, 0),	/* XY_MONO_PAT_BLT */
+		DECODE_VAR(0x53U, 0xFFU, 0),	/* XY_SRC_COPY_BLT */
+		DECODE_VAR(0x54U, 0xFFU, 0),	/* XY_MONO_SRC_COPY_BLT */
+		DECODE_VAR(0x55U, 0xFFU, 0),	/* XY_FULL_BLT */
+		DECODE_VAR(0x56U, 0xFFU, 0),	/* XY_FULL_MONO_SRC_BLT */
+		DECODE_VAR(0x57U, 0xFFU, 0),	/* XY_FULL_MONO_PATTERN_BLT */
+		DECODE_VAR(0x58U, 0xFFU, 0),	/* XY_FULL_MONO_PATTERN_MONO_SRC_BLT */
+		DECODE_VAR(0x59U, 0xFFU, 0),	/* XY_MONO_PAT_FIXED_BLT */
+		DECODE_VAR(0x71U, 0xFFU, 0),	/* XY_MONO_SRC_COPY_IMMEDIATE_BLT */
+		DECODE_VAR(0x72U, 0xFFU, 0),	/* XY_PAT_BLT_IMMEDIATE */
+		DECODE_VAR(0x75U, 0xFFU, 0),	/* XY_FULL_MONO_SRC_IMMEDIATE_PATTERN_BLT */
+		DECODE_VAR(0x76U, 0xFFU, 0),	/* XY_PAT_CHROMA_BLT */
+		DECODE_VAR(0x77U, 0xFFU, 0),	/* XY_PAT_CHROMA_BLT_IMMEDIATE */
+	};
+	static DecodeOpcode const render_opcodes[] =
+	{
+		DECODE_FIXED(0x06U, 1U, LOG_STATE),	/* 3DSTATE_AA_CMD */
+		DECODE_FIXED(0x07U, 1U, LOG_STATE),	/* 3DSTATE_RASTER_RULES_CMD */
+		DECODE_FIXED(0x08U, 1U, &CLASS::decode_backface_stencil_ops),	/* 3DSTATE_BACKFACE_STENCIL_OPS */
+		DECODE_FIXED(0x09U, 1U, LOG_STATE),	/* 3DSTATE_BACKFACE_STENCIL_MASKS */
+		DECODE_FIXED(0x0BU, 1U, &CLASS::decode_independent_alpha_blend),	/* 3DSTATE_INDEPENDENT_ALPHA_BLEND_CMD */
+		DECODE_FIXED(0x0CU, 1U, LOG_STATE),	/* 3DSTATE_MODES_5_CMD */
+		DECODE_FIXED(0x0DU, 1U, &CLASS::decode_modes_4),	/* 3DSTATE_MODES_4_CMD */
+		DECODE_FIXED(0x15U, 1U, LOG_STATE),	/* 3DSTATE_FOG_COLOR_CMD */
+		DECODE_SELF(0x1CU, &CLASS::decode_3d_1c),
+		DECODE_SELF(0x1DU, &CLASS::decode_3d_1d),
+		DECODE_SELF(0x1FU, &CLASS::ip_prim3d),	/* PRIM3D */
+	};
+	static DecodeOpcode const render_1d_opcodes[] =
+	{
+		DECODE_VAR(0x00U, 0xFFFFU, &CLASS::decode_map_state),	/* 3DSTATE_MAP_STATE */
+		DECODE_VAR(0x01U, 0xFFFFU, &CLASS::decode_sampler_state),	/* 3DSTATE_SAMPLER_STATE */
+		DECODE_SELF(0x04U, &CLASS::ip_load_immediate),	/* 3DSTATE_LOAD_STATE_IMMEDIATE_1 */
+		DECODE_VAR(0x05U, 0xFFFFU, &CLASS::decode_pixel_shader_program),	/* 3DSTATE_PIXEL_SHADER_PROGRAM */
+		DECODE_VAR(0x06U, 0xFFFFU, &CLASS::decode_pixel_shader_constants),	/* 3DSTATE_PIXEL_SHADER_CONSTANTS */
+		DECODE_VAR(0x80U, 0xFFFFU, &CLASS::decode_draw_rect),	/* 3DSTATE_DRAW_RECT_CMD */
+		DECODE_VAR(0x81U, 0xFFFFU, &CLASS::decode_scissor_rect),	/* 3DSTATE_SCISSOR_RECT_0_CMD */
+		DECODE_VAR(0x83U, 0xFFFFU, LOG_STATE),	/* 3DSTATE_STIPPLE */
+		DECODE_VAR(0x85U, 0xFFFFU, LOG_STATE),	/* 3DSTATE_DST_BUF_VARS_CMD */
+		DECODE_VAR(0x88U, 0xFFFFU, &CLASS::decode_const_blend_color),	/* 3DSTATE_CONST_BLEND_COLOR_CMD */
+		DECODE_VAR(0x89U, 0xFFFFU, LOG_STATE),	/* 3DSTATE_FOG_MODE_CMD */
+		DECODE_VAR(0x8EU, 0xFFFFU, &CLASS::decode_buf_info),	/* 3DSTATE_BUF_INFO_CMD */
+		DECODE_VAR(0x97U, 0xFFFFU, &CLASS::decode_depth_offset_scale),	/* 3DSTATE_DEPTH_OFFSET_SCALE */
+		DECODE_SELF(0x9CU, &CLASS::ip_clear_params),	/* 3DSTATE_CLEAR_PARAMETERS */
+	};
+	static DecodeEntry const unknown_1d = { &CLASS::decode_unknown, 0U, 0xFFFFU };
+	size_t i;
+
+	if (!OSCompareAndSwap(0U, 1U, &decode_tables_state)) {
+		while (decode_tables_state != 2U)
+			IOSleep(1U);
+		return;
+	}
+	for (i = 0U; i != sizeof mi_opcodes / sizeof mi_opcodes[0]; ++i)
+		decode_mi_table[mi_opcodes[i].opcode] = mi_opcodes[i].entry;
+	for (i = 0U; i != sizeof blt_opcodes / sizeof blt_opcodes[0]; ++i)
+		decode_2d_table[blt_opcodes[i].opcode] = blt_opcodes[i].entry;
+	for (i = 0U; i != sizeof render_opcodes / sizeof render_opcodes[0]; ++i)
+		decode_3d_table[render_opcodes[i].opcode] = render_opcodes[i].entry;
+	/*
+	 * Unknown 3DSTATE_1D commands still carry their length
+	 */
+	for (i = 0U; i != 256U; ++i)
+		decode_3d_1d_table[i] = unknown_1d;
+	for (i = 0U; i != sizeof render_1d_opcodes / sizeof render_1d_opcodes[0]; ++i)
+		decode_3d_1d_table[render_1d_opcodes[i].opcode] = render_1d_opcodes[i].entry;
+	OSCompareAndSwap(1U, 2U, &decode_tables_state);	// also a barrier for the stores above
+}
+
+#undef LOG_STATE
+#undef DECODE_SELF
+#undef DECODE_VAR
+#undef DECODE_FIXED
+
 #pragma mark -
 #pragma mark Global Methods
 #pragma mark -
@@ -1996,6 +2848,7 @@ bool CLASS::start(class CEsvga2Accel* provider, int logLevel)
 		return false;
 	m_provider = provider;
 	m_log_level = logLevel;
+	build_decode_tables();
 	m_float_cache = static_cast<float*>(IOMallocAligned(64U * sizeof(float), 16U));	// SSE-ready
 	if (!m_float_cache) {
 		PPLog(1, "%s: IOMallocAligned failed\n", __FUNCTION__);
@@ -2028,7 +2881,10 @@ void CLASS::stop(void)
 HIDDEN
 void CLASS::discard_cached_state(void)
 {
+	flush_batch();
 	param_cache_mask = 0U;
+	bzero(&rs_shadow_valid[0], sizeof rs_shadow_valid);
+	bzero(&ts_shadow_valid[0], sizeof ts_shadow_valid);
 }
 
 HIDDEN
@@ -2038,6 +2894,7 @@ void CLASS::detach_render_targets(void)
 	SVGA3dSurfaceImageId hostImage;
 	if (!m_provider || !isIdValid(m_context_id))
 		return;
+	flush_batch();
 	hostImage.sid = SVGA_ID_INVALID;
 	hostImage.face = 0U;
 	hostImage.mipmap = 0U;
@@ -2049,39 +2906,89 @@ void CLASS::detach_render_targets(void)
 	m_provider->unlock3D();
 }
 
+/*
+ * Binds the client vertex buffer that S0 addresses refer to,
+ *   with its vertex data at offset within tx's memory.  Holds
+ *   a reference on tx.  Dropping the last reference on the old
+ *   buffer deletes it, so this is called with the shared lock held.
+ */
+HIDDEN
+void CLASS::set_vertex_buffer(CEsvga2TextureBuffer* tx, size_t offset, uint32_t address)
+{
+	IOMemoryDescriptor* md = tx ? tx->xfer.md : 0;
+
+	flush_batch();
+	if (tx)
+		__sync_fetch_and_add(&tx->sys_obj->refcount, 1);
+	if (m_vb.tx &&
+		__sync_fetch_and_add(&m_vb.tx->sys_obj->refcount, -1) == 1)
+		m_vb.tx->creator->delete_texture(m_vb.tx);
+	if (md)
+		md->retain();
+	if (m_vb.md)
+		m_vb.md->release();
+	m_vb.tx = tx;
+	m_vb.md = md;
+	m_vb.offset = offset;
+	m_vb.size = (md && md->getLength() > offset) ? md->getLength() - offset : 0U;
+	m_vb.address = address;
+	m_vb.uploaded_bytes = 0U;
+	m_vb.verified = false;
+}
+
 HIDDEN
 uint32_t CLASS::submit_buffer(uint32_t* kernel_buffer_ptr, uint32_t size_dwords)
 {
-	uint32_t *p, *limit, cmd, skip;
+	uint32_t *p, *limit, cmd, skip, fence;
+	SVGA3D* svga3d;
+	DecodeClass const* cls;
+	bool unknown = false;
 #if LOGGING_LEVEL >= 4
 	PPLog(4, "%s:   offset %d, size %u [in dwords]\n", __FUNCTION__,
 		  static_cast<int>(kernel_buffer_ptr - &m_command_buffer.kernel_ptr->downstream[0]),
 		  size_dwords);
 #endif
+	/*
+	 * The client may have rewritten its vertex buffer since
+	 */
+	m_vb.uploaded_bytes = 0U;
+	m_vb.verified = false;
 	p = kernel_buffer_ptr;
 	limit = p + size_dwords;
 	for (; p < limit; p += skip) {
 		cmd = *p;
 		skip = 0U;
-		switch (cmd >> 29) {
-			case 0U:
-				skip = decode_mi(p, cmd);
-				break;
-			case 2U:
-				skip = decode_2d(p, cmd);
-				break;
-			case 3U:
-				skip = decode_3d(p, cmd);
-				break;
-		}
+		/*
+		 * Anything but another primitive (or padding) may
+		 *   change state, so draw what's pending first
+		 */
+		if (cmd && (cmd >> 24) != 0x7FU /* PRIM3D */)
+			flush_batch();
+		cls = &decode_classes[cmd >> 29];
+		if (cls->table)
+			skip = decode_entry(&cls->table[(cmd >> cls->shift) & cls->mask], p, cmd);
 		if (!skip) {
-			PPLog(1, "%s:   Unknown cmd %#x\n", __FUNCTION__, cmd);
+			/*
+			 * Log only the first of a run of unknown dwords
+			 */
+			if (!unknown)
+				PPLog(1, "%s:   Unknown cmd %#x\n", __FUNCTION__, cmd);
+			unknown = true;
 			skip = 1U;
-		}
+		} else
+			unknown = false;
 	}
+	flush_batch();
 	/*
-	 * Note: original inserts a fence and returns the fence
-	 *   should probably do the same for finish()
+	 * Fence the batch, so waiting for it needn't drain the FIFO
 	 */
-	return 0U;
+	svga3d = m_provider->lock3D();
+	if (!svga3d)
+		return 0U;
+	fence = svga3d->InsertFence();
+	m_provider->unlock3D();
+#if LOGGING_LEVEL >= 4
+	PPLog(4, "%s:   fence %u\n", __FUNCTION__, fence);
+#endif
+	return fence;
 }
@@ -24,6 +24,11 @@
 #include <libkern/c++/OSObject.h>
 #include "VertexArray.h"
 
+#define MAX_NUM_DECLS 12U
+#define SHADER_CACHE_SIZE 64U
+#define SHADER_CACHE_MAX 48U
+#define VERTEX_FORMAT_CACHE_SIZE 8U
+
 class CEsvga2IPP: public OSObject
 {
 	OSDeclareDefaultStructors(CEsvga2IPP);
@@ -36,18 +41,77 @@ private:
 
 	uint32_t m_context_id;
 	float* m_float_cache;
-	struct ShaderEntry* m_shader_cache;
+
 	/*
-	 * TBD: should shader ids be unique system-wide???
+	 * Shaders defined on this context, open-addressed by program hash
 	 */
-	uint32_t m_next_shid;
+	struct ShaderEntry {
+		uint64_t hash;
+		CEsvga2Accel::ShaderProgram* program;	// retained while cached
+		SVGA3dShaderType shader_type;
+		uint32_t shader_id;
+		uint32_t tc2s_map;
+		uint8_t tc2s_map_valids;
+		uint32_t lru_stamp;
+	};
+	ShaderEntry m_shader_cache[SHADER_CACHE_SIZE];
+	uint32_t m_shader_cache_count;
+	uint32_t m_shader_cache_clock;
+	uint64_t m_shader_id_mask;	// shader ids are per-context
 	uint32_t m_active_shid;
 
+	/*
+	 * Decoded vertex formats, direct-mapped by S2/S4
+	 */
+	struct VertexFormat {
+		uint32_t s2;
+		uint32_t s4;
+		size_t num_decls;	// 0 if slot unused
+		SVGA3dVertexDecl decls[MAX_NUM_DECLS];
+	};
+	VertexFormat m_vertex_formats[VERTEX_FORMAT_CACHE_SIZE];
+	VertexFormat const* m_vertex_format;	// for current S2/S4, 0 if unknown
+
 	/*
 	 * Buffers for vertex/index arrays (need GMRs)
 	 */
 	VertexArray m_arrays;
 
+	/*
+	 * Client vertex buffer for indirect primitives.  Its data
+	 *   lives in the texture's own buffer surface, and is only
+	 *   uploaded again when its hash changes.  Without one, it's
+	 *   copied via m_vb_array once per submission.
+	 */
+	struct {
+		struct CEsvga2TextureBuffer* tx;	// referenced
+		class IOMemoryDescriptor* md;	// retained
+		size_t offset;		// of vertex data within md
+		size_t size;
+		uint32_t address;	// as programmed into S0
+		size_t uploaded_bytes;
+		uint32_t sid;
+		bool verified;		// tx->vb_hash checked this submission
+	} m_vb;
+	VertexArray m_vb_array;
+	VertexArray m_index_array;
+
+	/*
+	 * Pending batch of primitives sharing one vertex format,
+	 *   drawn with a single DMA and DrawPrimitives
+	 */
+	struct {
+		uint8_t* vertex_ptr;
+		size_t vsize;
+		size_t num_vertices;
+		size_t num_decls;
+		size_t num_ranges;
+		uint32_t s2;
+		uint32_t s4;
+		SVGA3dVertexDecl decls[MAX_NUM_DECLS];
+		SVGA3dPrimitiveRange ranges[SVGA3D_MAX_DRAW_PRIMITIVE_RANGES];
+	} m_batch;
+
 	/*
 	 * Intel 915 Emulator State
 	 */
@@ -66,12 +130,24 @@ private:
 	uint8_t tc2s_map_valids; // 1 bit for each tc mapped in tc2s_map
 	uint16_t bound_samplers;
 
+	/*
+	 * Shadow of SVGA3D render and texture states last sent to the host
+	 */
+	uint32_t rs_shadow[SVGA3D_RS_MAX];
+	uint32_t rs_shadow_valid[(SVGA3D_RS_MAX + 31U) / 32U];
+	uint32_t ts_shadow[16][SVGA3D_TS_MAX];
+	uint32_t ts_shadow_valid[16];	// 1 bit for each texture state name
+
 	/*
 	 * Private Methods
 	 */
 	void Init();
 	void Cleanup();
-	struct ShaderEntry const* cache_shader(uint32_t const* source, uint32_t num_dwords);
+	void prepare_shader_program(CEsvga2Accel::ShaderProgram* program,
+								uint32_t const* source,
+								uint32_t num_dwords);
+	void evict_shader();
+	ShaderEntry const* cache_shader(uint32_t const* source, uint32_t num_dwords);
 	void purge_shader_cache();
 	void unbind_samplers(uint16_t mask);
 	void calc_adjustment_map(uint8_t* map) const;
@@ -82,8 +158,18 @@ private:
 							   size_t num_decls) const;
 	uint8_t calc_color_write_enable(void) const;
 	bool cache_misc_reg(uint8_t regnum, uint32_t value);
-	void ip_prim3d_poly(uint32_t const* vertex_data, size_t num_vertex_dwords);
+	void set_render_state(uint32_t numStates, SVGA3dRenderState* states);
+	void set_texture_state(uint32_t numStates, SVGA3dTextureState* states);
+	VertexFormat const* get_vertex_format(void);
+	void flush_batch(void);
+	void ip_prim3d_flat_poly(uint32_t const* vertex_data, size_t num_vertex_dwords);
 	void ip_prim3d_direct(uint32_t prim_kind, uint32_t const* vertex_data, size_t num_vertex_dwords);
+	IOReturn sync_vertex_buffer(size_t num_bytes);
+	IOReturn upload_vertex_buffer(size_t vertex_offset,
+								  size_t num_vertices,
+								  SVGA3dVertexDecl const* decls,
+								  size_t num_decls);
+	void ip_prim3d_indirect(uint32_t prim_kind, uint16_t const* indices, size_t num_indices, uint32_t start);
 	uint32_t ip_prim3d(uint32_t* p, uint32_t cmd);
 	uint32_t ip_load_immediate(uint32_t* p, uint32_t cmd);
 	uint32_t ip_clear_params(uint32_t* p, uint32_t cmd);
@@ -97,10 +183,45 @@ private:
 	void ip_load_ps_const(uint32_t* p);
 	void ip_buf_info(uint32_t* p);
 	void ip_draw_rect(uint32_t* p);
-	uint32_t decode_mi(uint32_t* p, uint32_t cmd);
-	uint32_t decode_2d(uint32_t* p, uint32_t cmd);
+	uint32_t decode_unknown(uint32_t* p, uint32_t cmd);
+	uint32_t decode_log_state(uint32_t* p, uint32_t cmd);
+	uint32_t decode_store_data_index(uint32_t* p, uint32_t cmd);
+	uint32_t decode_map_state(uint32_t* p, uint32_t cmd);
+	uint32_t decode_sampler_state(uint32_t* p, uint32_t cmd);
+	uint32_t decode_pixel_shader_program(uint32_t* p, uint32_t cmd);
+	uint32_t decode_pixel_shader_constants(uint32_t* p, uint32_t cmd);
+	uint32_t decode_draw_rect(uint32_t* p, uint32_t cmd);
+	uint32_t decode_buf_info(uint32_t* p, uint32_t cmd);
+	uint32_t decode_depth_offset_scale(uint32_t* p, uint32_t cmd);
+	uint32_t decode_scissor_rect(uint32_t* p, uint32_t cmd);
+	uint32_t decode_const_blend_color(uint32_t* p, uint32_t cmd);
+	uint32_t decode_backface_stencil_ops(uint32_t* p, uint32_t cmd);
+	uint32_t decode_independent_alpha_blend(uint32_t* p, uint32_t cmd);
+	uint32_t decode_modes_4(uint32_t* p, uint32_t cmd);
+	uint32_t decode_3d_1c(uint32_t* p, uint32_t cmd);
 	uint32_t decode_3d_1d(uint32_t* p, uint32_t cmd);
-	uint32_t decode_3d(uint32_t* p, uint32_t cmd);
+	static void build_decode_tables(void);
+
+public:
+	/*
+	 * Handler for an i915 command, and how to find its length
+	 *   in dwords.  If both length and length_mask are 0, the
+	 *   handler returns the length, otherwise a non-zero return
+	 *   overrides it.
+	 */
+	typedef uint32_t (CEsvga2IPP::*decode_function_t)(uint32_t* p, uint32_t cmd);
+	struct DecodeEntry {
+		decode_function_t handler;
+		uint16_t length;		// fixed
+		uint16_t length_mask;	// variable, (cmd & length_mask) + 2
+	};
+	struct DecodeOpcode {
+		uint8_t opcode;
+		DecodeEntry entry;
+	};
+
+private:
+	uint32_t decode_entry(DecodeEntry const* entry, uint32_t* p, uint32_t cmd);
 
 public:
 	/*
@@ -114,6 +235,7 @@ public:
 	void stop(void);
 	void discard_cached_state(void);
 	void detach_render_targets(void);
+	void set_vertex_buffer(struct CEsvga2TextureBuffer* tx, size_t offset, uint32_t address);
 	uint32_t submit_buffer(uint32_t* kernel_buffer_ptr, uint32_t size_dwords);
 };
 
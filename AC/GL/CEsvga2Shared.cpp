@@ -19,6 +19,7 @@
 */
 
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <libkern/libkern.h>
 #define GL_INCL_SHARED
 #include "GLCommon.h"
 #include "CEsvga2Accel.h"
@@ -74,6 +75,13 @@ bool isPagedOn(GLDSysObject* sys_obj, uint8_t face, uint8_t mipmap)
 	return ((~sys_obj->pageoff[face] & sys_obj->pageon[face]) >> mipmap) & 1U;
 }
 
+static
+int compare_lru_stamps(void const* a, void const* b)
+{
+	return static_cast<int>((*static_cast<CEsvga2TextureBuffer* const*>(a))->lru_stamp -
+							(*static_cast<CEsvga2TextureBuffer* const*>(b))->lru_stamp);
+}
+
 HIDDEN
 IOReturn mapGLDTextureHeader(CEsvga2TextureBuffer* tx, IOMemoryMap** map)
 {
@@ -273,6 +281,7 @@ void CLASS::delete_texture_internal(class CEsvga2Accel* provider,
 		shared->free_buf_handle(texture, texture->sys_obj->object_id);
 		shared->free_client_shared(texture->sys_obj);
 		shared->unlink_texture(texture);
+		shared->m_texture_host_bytes -= texture->host_bytes;
 	}
 	finalize_texture(provider, texture);
 	releaseVendorTextureBuffer(texture, sizeof *texture);
@@ -293,6 +302,7 @@ void CLASS::finalize_texture(class CEsvga2Accel* provider, CEsvga2TextureBuffer*
 		texture->client_map->release();
 		texture->client_map = 0;
 	}
+	texture->xfer.complete(provider);
 	texture->xfer.discard();
 #ifdef ATTACH_SURFACE_TEXTURE
 	if (texture->sys_obj_type == TEX_TYPE_SURFACE && texture->linked_surface)
@@ -780,15 +790,25 @@ IOReturn CLASS::pageoffDirtyTexture(CEsvga2TextureBuffer* tx)
 	CEsvga2TextureBuffer* ltx;
 	GLDTextureHeader *headers, *gld_th;
 
+	syncTextureUpload(tx);
 	if (tx->sys_obj->vstate & 0x11U) {	// is the descriptor in volatile state?
 		tx->sys_obj->vstate |= 2U;
 		return kIOReturnSuccess;
 	}
+	sys_obj_type = tx->sys_obj_type;
+	if (sys_obj_type == TEX_TYPE_VB) {
+		/*
+		 * The pages of a buffer object are only dirtied by
+		 *   AsyncReadDrawBuffer DMAs, which syncTextureUpload
+		 *   has just waited on
+		 */
+		tx->sys_obj->pageoff[0] |= tx->sys_obj->pageon[0];
+		return kIOReturnSuccess;
+	}
 	if (!m_provider)
 		return kIOReturnNotReady;
 	if (!isIdValid(tx->surface_id))
 		return kIOReturnNotReady;
-	sys_obj_type = tx->sys_obj_type;
 	if (sys_obj_type != TEX_TYPE_STD &&
 		sys_obj_type != TEX_TYPE_OOB) {
 		SHLog(1, "%s: called for texture type %u, unsupported\n", __FUNCTION__, sys_obj_type);
@@ -859,6 +879,150 @@ clean1:
 	return rc;
 }
 
+/*
+ * Waits for any upload still reading the texture's pages
+ */
+HIDDEN
+void CLASS::syncTextureUpload(CEsvga2TextureBuffer* tx)
+{
+	switch (tx->sys_obj_type) {
+		case TEX_TYPE_AGPREF:
+		case TEX_TYPE_OOB:
+			if (tx->linked_agp)
+				tx->linked_agp->xfer.complete(m_provider);
+			break;
+	}
+	tx->xfer.complete(m_provider);
+}
+
+/*
+ * Unwires the pages of textures whose uploads have finished
+ *   Note: caller holds the shared lock
+ */
+HIDDEN
+void CLASS::retireTextureUploads()
+{
+	CEsvga2TextureBuffer* tx;
+
+	for (tx = m_texture_list; tx; tx = tx->next)
+		tx->xfer.retire(m_provider);
+}
+
+/*
+ * Textures are evicted only if their contents can be
+ *   restored from system memory
+ */
+HIDDEN
+bool CLASS::is_evictable(CEsvga2TextureBuffer* tx)
+{
+	uint8_t face;
+
+	if (!isIdValid(tx->surface_id) || !tx->sys_obj)
+		return false;
+	if (tx->sys_obj->vstate & 0x10U)
+		return false;
+	switch (tx->sys_obj_type) {
+		case TEX_TYPE_AGPREF:
+			return true;
+		case TEX_TYPE_STD:
+		case TEX_TYPE_OOB:
+			for (face = 0U; face != tx->num_faces; ++face)
+				if (tx->sys_obj->pageon[face] & ~tx->sys_obj->pageoff[face])
+					return false;	// host has the only copy
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Destroys the host surface, and marks all levels paged off
+ *   so that alloc_and_load_texture recreates and reloads it
+ */
+HIDDEN
+void CLASS::evict_texture(CEsvga2TextureBuffer* tx)
+{
+	uint8_t face;
+
+	SHLog(3, "%s: texture %u, %u bytes\n", __FUNCTION__, tx->sys_obj->object_id, tx->host_bytes);
+	if (isIdValid(tx->yuv_shadow)) {
+		m_provider->destroySurface(tx->yuv_shadow);
+		m_provider->FreeSurfaceID(tx->yuv_shadow);
+		tx->yuv_shadow = SVGA_ID_INVALID;
+	}
+	m_provider->destroySurface(tx->surface_id);
+	m_provider->FreeSurfaceID(tx->surface_id);
+	tx->surface_id = SVGA_ID_INVALID;
+	m_texture_host_bytes -= tx->host_bytes;
+	tx->host_bytes = 0U;
+	if (tx->sys_obj_type != TEX_TYPE_AGPREF)
+		for (face = 0U; face != tx->num_faces; ++face)
+			tx->sys_obj->pageon[face] = 0U;
+}
+
+HIDDEN
+void CLASS::touchTexture(CEsvga2TextureBuffer* tx)
+{
+	tx->lru_stamp = ++m_texture_clock;
+}
+
+/*
+ * Accounts for a newly created host surface
+ */
+HIDDEN
+void CLASS::residentTexture(CEsvga2TextureBuffer* tx, uint32_t host_bytes)
+{
+	m_texture_host_bytes += host_bytes - tx->host_bytes;
+	tx->host_bytes = host_bytes;
+	touchTexture(tx);
+}
+
+HIDDEN
+bool CLASS::is_eviction_candidate(CEsvga2TextureBuffer* tx, uint32_t since)
+{
+	return static_cast<int>(tx->lru_stamp - since) <= 0 &&
+		tx->host_bytes &&
+		is_evictable(tx);
+}
+
+/*
+ * Evicts least recently used textures until the host footprint
+ *   fits the budget.  Textures used after stamp 'since' are kept.
+ *   The candidates are gathered and sorted once, oldest first.
+ *   Note: caller holds the shared lock
+ */
+HIDDEN
+void CLASS::evictTextures(uint32_t since)
+{
+	CEsvga2TextureBuffer *tx, **lru;
+	size_t budget, count, i, lru_bytes;
+
+	if (!m_provider)
+		return;
+	budget = m_provider->getTextureBudget();
+	if (!budget || m_texture_host_bytes <= budget)
+		return;
+	count = 0U;
+	for (tx = m_texture_list; tx; tx = tx->next)
+		if (is_eviction_candidate(tx, since))
+			++count;
+	if (!count)
+		return;
+	lru_bytes = count * sizeof *lru;
+	lru = static_cast<typeof lru>(IOMalloc(lru_bytes));
+	if (!lru) {
+		SHLog(1, "%s: IOMalloc(%lu) failed\n", __FUNCTION__, lru_bytes);
+		return;
+	}
+	i = 0U;
+	for (tx = m_texture_list; tx && i != count; tx = tx->next)
+		if (is_eviction_candidate(tx, since))
+			lru[i++] = tx;
+	qsort(lru, count, sizeof *lru, &compare_lru_stamps);
+	for (i = 0U; i != count && m_texture_host_bytes > budget; ++i)
+		evict_texture(lru[i]);
+	IOFree(lru, lru_bytes);
+}
+
 HIDDEN
 bool CLASS::initializeTexture(CEsvga2TextureBuffer* tx, VendorNewTextureDataStruc const* tds)
 {
@@ -46,6 +46,8 @@ private:
 	void* m_client_sys_objs_kernel_ptr;
 	IOLock* m_shared_lock;
 	int m_log_level;
+	size_t m_texture_host_bytes;		// host footprint of all textures
+	uint32_t m_texture_clock;
 
 	void Cleanup();
 	bool alloc_handles();
@@ -68,6 +70,9 @@ private:
 										CEsvga2TextureBuffer*);
 	static void free_orphan_texture(class CEsvga2Accel*, struct IOTextureBuffer*);
 	static void finalize_texture(class CEsvga2Accel*, CEsvga2TextureBuffer*);
+	static bool is_evictable(CEsvga2TextureBuffer*);
+	static bool is_eviction_candidate(CEsvga2TextureBuffer*, uint32_t since);
+	void evict_texture(CEsvga2TextureBuffer*);
 	CEsvga2TextureBuffer* new_agp_texture(mach_vm_address_t pixels,
 										  size_t texture_size,
 										  uint32_t read_only,
@@ -101,6 +106,12 @@ public:
 											 uint32_t read_only,
 											 mach_vm_address_t* sys_obj_client_addr);
 	IOReturn pageoffDirtyTexture(CEsvga2TextureBuffer*);
+	void syncTextureUpload(CEsvga2TextureBuffer*);
+	void retireTextureUploads();
+	uint32_t getTextureClock() const { return m_texture_clock; }
+	void touchTexture(CEsvga2TextureBuffer*);
+	void residentTexture(CEsvga2TextureBuffer*, uint32_t host_bytes);
+	void evictTextures(uint32_t since);
 	void delete_texture(CEsvga2TextureBuffer* texture) { delete_texture_internal(m_provider, this, texture); }
 	void lockShared() { IOLockLock(m_shared_lock); }
 	void unlockShared() { IOLockUnlock(m_shared_lock); }
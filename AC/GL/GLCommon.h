@@ -64,6 +64,8 @@ struct CEsvga2TextureBuffer
 		uint32_t surface_id;
 		int surface_format;
 		uint32_t yuv_shadow;
+		uint32_t host_bytes;		// footprint of surface_id and yuv_shadow
+		uint32_t lru_stamp;
 	};
 	union {							// offset 0x80 Note: 0x80 - 0x98 a sub-structure
 		CEsvga2TextureBuffer* linked_agp;	// for TEX_TYPE_AGPREF, TEX_TYPE_OOB
@@ -79,6 +81,10 @@ struct CEsvga2TextureBuffer
 			uint32_t fb_idx_mask;			// offset 0x88
 			uint32_t cgs_surface_id;		// offset 0x8C
 		};
+		struct {							// for TEX_TYPE_VB
+			uint64_t vb_hash;				// of the first vb_valid_bytes
+			uint32_t vb_valid_bytes;		// current in surface_id
+		};
 	};
 	uint64_t vram_tile_pages;		// offset 0x98
 	uint32_t vram_page_bytes;		// offset 0xA0
@@ -0,0 +1,617 @@
+/*
+
+    CEsvga2 - ChrisEric1 Super Video Graphics Array 2
+    Copyright (C) 2023-2024, Christopher Eric Lentocha
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <IOKit/IOLib.h>
+#define GL_INCL_PRIVATE
+#include "GLCommon.h"
+#include "ShaderTranslator.h"
+
+#define HIDDEN __attribute__((visibility("hidden")))
+
+/*
+ * i915 fragment program
+ */
+#define I915_REG_TYPE_R			0U
+#define I915_REG_TYPE_T			1U
+#define I915_REG_TYPE_CONST		2U
+#define I915_REG_TYPE_S			3U
+#define I915_REG_TYPE_OC		4U
+#define I915_REG_TYPE_OD		5U
+#define I915_T_DIFFUSE			8U
+#define I915_T_SPECULAR			9U
+#define I915_MAX_TEMPS			16U
+#define I915_MAX_CONSTS			32U
+
+/*
+ * Direct3D 9 shader tokens, as understood by SVGA3D
+ */
+#define D3DSIO_MOV				0x01U
+#define D3DSIO_ADD				0x02U
+#define D3DSIO_MAD				0x04U
+#define D3DSIO_MUL				0x05U
+#define D3DSIO_RCP				0x06U
+#define D3DSIO_RSQ				0x07U
+#define D3DSIO_DP3				0x08U
+#define D3DSIO_DP4				0x09U
+#define D3DSIO_MIN				0x0AU
+#define D3DSIO_MAX				0x0BU
+#define D3DSIO_EXP				0x0EU
+#define D3DSIO_LOG				0x0FU
+#define D3DSIO_FRC				0x13U
+#define D3DSIO_DCL				0x1FU
+#define D3DSIO_TEXKILL			0x41U
+#define D3DSIO_TEX				0x42U
+#define D3DSIO_DEF				0x51U
+#define D3DSIO_CMP				0x58U
+#define D3DSIO_DP2ADD			0x5AU
+#define D3DSIO_END				0xFFFFU
+#define D3DSPR_TEMP				0U
+#define D3DSPR_INPUT			1U
+#define D3DSPR_CONST			2U
+#define D3DSPR_TEXTURE			3U
+#define D3DSPR_COLOROUT			8U
+#define D3DSPR_DEPTHOUT			9U
+#define D3DSPR_SAMPLER			10U
+#define D3DSP_SWIZZLE_ID		0xE4U
+#define D3DSPSM_NEG				0x01000000U
+#define D3DSPDM_SATURATE		0x00100000U
+#define PS_2_0_VERSION			0xFFFF0200U
+#define PS_2_0_MAX_TEMPS		12U
+
+#define NO_REG 0xFFU
+
+struct Translation
+{
+	uint32_t* body;
+	size_t body_len;
+	uint8_t rmap[I915_MAX_TEMPS];	// i915 temps to ps_2_0 temps
+	uint16_t free_temps;			// ps_2_0 temps available
+	uint16_t scratch;				// ps_2_0 temps used by current instruction
+	uint8_t oc_temp;				// stands in for oC0
+	uint8_t od_temp;				// stands in for oDepth
+	uint8_t const_reg;				// holds { 0, 1, 0, 0 }
+	bool need_const;
+	uint32_t tc2s_map;
+	uint8_t tc2s_map_valids;
+};
+
+#pragma mark -
+#pragma mark Static Functions
+#pragma mark -
+
+static inline
+uint32_t d3d_reg(uint32_t type, uint32_t nr)
+{
+	return 0x80000000U | ((type & 7U) << 28) | ((type & 0x18U) << 8) | nr;
+}
+
+static inline
+uint32_t d3d_inst(uint32_t opcode, uint32_t num_params, uint32_t control = 0U)
+{
+	return opcode | (control << 16) | (num_params << 24);
+}
+
+static inline
+void emit(Translation* x, uint32_t token)
+{
+	x->body[x->body_len++] = token;
+}
+
+static
+uint8_t alloc_temp(Translation* x)
+{
+	uint8_t r;
+	if (!x->free_temps)
+		return NO_REG;
+	r = static_cast<uint8_t>(__builtin_ctz(x->free_temps));
+	x->free_temps &= ~(1U << r);
+	return r;
+}
+
+static
+uint8_t alloc_scratch(Translation* x)
+{
+	uint8_t r = alloc_temp(x);
+	if (r != NO_REG)
+		x->scratch |= (1U << r);
+	return r;
+}
+
+static inline
+void free_scratch(Translation* x)
+{
+	x->free_temps |= x->scratch;
+	x->scratch = 0U;
+}
+
+/*
+ * Maps an i915 register to a ps_2_0 register token (no swizzle)
+ */
+static
+bool map_reg(Translation* x, uint32_t type, uint32_t nr, uint32_t* token)
+{
+	switch (type) {
+		case I915_REG_TYPE_R:
+			if (nr >= I915_MAX_TEMPS)
+				return false;
+			if (x->rmap[nr] == NO_REG) {
+				x->rmap[nr] = alloc_temp(x);
+				if (x->rmap[nr] == NO_REG)
+					return false;
+			}
+			*token = d3d_reg(D3DSPR_TEMP, x->rmap[nr]);
+			return true;
+		case I915_REG_TYPE_T:
+			if (nr < 8U)
+				*token = d3d_reg(D3DSPR_TEXTURE, nr);
+			else if (nr == I915_T_DIFFUSE)
+				*token = d3d_reg(D3DSPR_INPUT, 0U);
+			else if (nr == I915_T_SPECULAR)
+				*token = d3d_reg(D3DSPR_INPUT, 1U);
+			else
+				return false;	// fog isn't a ps_2_0 input
+			return true;
+		case I915_REG_TYPE_CONST:
+			if (nr >= I915_MAX_CONSTS)
+				return false;
+			*token = d3d_reg(D3DSPR_CONST, nr);
+			return true;
+		case I915_REG_TYPE_OC:
+			if (x->oc_temp == NO_REG) {
+				x->oc_temp = alloc_temp(x);
+				if (x->oc_temp == NO_REG)
+					return false;
+			}
+			*token = d3d_reg(D3DSPR_TEMP, x->oc_temp);
+			return true;
+		case I915_REG_TYPE_OD:
+			if (x->od_temp == NO_REG) {
+				x->od_temp = alloc_temp(x);
+				if (x->od_temp == NO_REG)
+					return false;
+			}
+			*token = d3d_reg(D3DSPR_TEMP, x->od_temp);
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Translates an i915 source operand.  Channels selecting 0 or 1,
+ *   or with mixed negation, are gathered into a scratch temp.
+ */
+static
+bool xlate_src(Translation* x, uint32_t type, uint32_t nr, uint32_t swizzle, uint32_t* token)
+{
+	uint32_t reg, c, sel, swz = 0U;
+	uint8_t masks[4] = { 0U, 0U, 0U, 0U };	// plain, negated, zero, one
+	uint8_t i, t;
+
+	if (!map_reg(x, type, nr, &reg))
+		return false;
+	for (c = 0U; c != 4U; ++c) {
+		sel = bit_select(swizzle, 12 - 4 * static_cast<int>(c), 4);
+		switch (sel & 7U) {
+			case 0U: case 1U: case 2U: case 3U:
+				swz |= (sel & 3U) << (2U * c);
+				masks[(sel & 8U) ? 1 : 0] |= (1U << c);
+				break;
+			case 4U:
+				masks[2] |= (1U << c);
+				break;
+			case 5U:
+				masks[3] |= (1U << c);
+				break;
+			default:
+				return false;
+		}
+	}
+	if (masks[0] == 15U) {
+		*token = reg | (swz << 16);
+		return true;
+	}
+	if (masks[1] == 15U) {
+		*token = reg | (swz << 16) | D3DSPSM_NEG;
+		return true;
+	}
+	t = alloc_scratch(x);
+	if (t == NO_REG)
+		return false;
+	for (i = 0U; i != 4U; ++i) {
+		if (!masks[i])
+			continue;
+		emit(x, d3d_inst(D3DSIO_MOV, 2U));
+		emit(x, d3d_reg(D3DSPR_TEMP, t) | (static_cast<uint32_t>(masks[i]) << 16));
+		switch (i) {
+			case 0U:
+				emit(x, reg | (swz << 16));
+				break;
+			case 1U:
+				emit(x, reg | (swz << 16) | D3DSPSM_NEG);
+				break;
+			case 2U:
+				emit(x, d3d_reg(D3DSPR_CONST, x->const_reg));		// .xxxx
+				x->need_const = true;
+				break;
+			case 3U:
+				emit(x, d3d_reg(D3DSPR_CONST, x->const_reg) | (0x55U << 16));	// .yyyy
+				x->need_const = true;
+				break;
+		}
+	}
+	*token = d3d_reg(D3DSPR_TEMP, t) | (D3DSP_SWIZZLE_ID << 16);
+	return true;
+}
+
+/*
+ * Keeps only the first channel, for scalar sources
+ */
+static inline
+uint32_t replicate(uint32_t token)
+{
+	uint32_t c = bit_select(token, 16, 2);
+	return (token & ~0x00FF0000U) | ((c * 0x55U) << 16);
+}
+
+static inline
+uint32_t negate(uint32_t token)
+{
+	return token ^ D3DSPSM_NEG;
+}
+
+static inline
+uint32_t scratch_src(uint8_t r)
+{
+	return d3d_reg(D3DSPR_TEMP, r) | (D3DSP_SWIZZLE_ID << 16);
+}
+
+static inline
+uint32_t scratch_dst(uint8_t r)
+{
+	return d3d_reg(D3DSPR_TEMP, r) | (15U << 16);
+}
+
+static
+void emit_op(Translation* x, uint32_t opcode, uint32_t dst, uint32_t num_srcs, uint32_t const* srcs)
+{
+	uint32_t i;
+	emit(x, d3d_inst(opcode, num_srcs + 1U));
+	emit(x, dst);
+	for (i = 0U; i != num_srcs; ++i)
+		emit(x, srcs[i]);
+}
+
+/*
+ * dst = src - trunc(src), i.e. fmod(src, 1.0)
+ */
+static
+bool emit_mod(Translation* x, uint32_t dst, uint32_t src)
+{
+	uint32_t ops[3];
+	uint8_t t0 = alloc_scratch(x), t1 = alloc_scratch(x);
+	if (t0 == NO_REG || t1 == NO_REG)
+		return false;
+	emit_op(x, D3DSIO_FRC, scratch_dst(t0), 1U, &src);
+	ops[0] = negate(src);
+	emit_op(x, D3DSIO_FRC, scratch_dst(t1), 1U, &ops[0]);
+	ops[0] = src;
+	ops[1] = scratch_src(t0);
+	ops[2] = negate(scratch_src(t1));
+	emit_op(x, D3DSIO_CMP, dst, 3U, &ops[0]);
+	return true;
+}
+
+static
+bool xlate_arith(Translation* x, uint32_t const* p)
+{
+	static uint8_t const d3d_opcodes[] = {
+		0U, D3DSIO_ADD, D3DSIO_MOV, D3DSIO_MUL, D3DSIO_MAD, D3DSIO_DP2ADD,
+		D3DSIO_DP3, D3DSIO_DP4, D3DSIO_FRC, D3DSIO_RCP, D3DSIO_RSQ,
+		D3DSIO_EXP, D3DSIO_LOG, D3DSIO_CMP, D3DSIO_MIN, D3DSIO_MAX
+	};
+	static uint8_t const num_srcs[] = {
+		0U, 2U, 1U, 2U, 3U, 3U, 2U, 2U, 1U, 1U, 1U, 1U, 1U, 3U, 2U, 2U, 1U, 1U, 1U, 2U, 2U
+	};
+	uint32_t opcode = p[0] >> 24, dst, srcs[3], ops[3];
+	uint8_t t;
+
+	if (!opcode)
+		return true;	// NOP
+	if (!map_reg(x, bit_select(p[0], 19, 3), bit_select(p[0], 14, 5), &dst))
+		return false;
+	dst |= bit_select(p[0], 10, 4) << 16;
+	if (bit_select(p[0], 22, 1))
+		dst |= D3DSPDM_SATURATE;
+	if (!xlate_src(x,
+				   bit_select(p[0], 7, 3),
+				   bit_select(p[0], 2, 5),
+				   bit_select(p[1], 16, 16),
+				   &srcs[0]))
+		return false;
+	if (num_srcs[opcode] >= 2U &&
+		!xlate_src(x,
+				   bit_select(p[1], 13, 3),
+				   bit_select(p[1], 8, 5),
+				   (bit_select(p[1], 0, 8) << 8) | bit_select(p[2], 24, 8),
+				   &srcs[1]))
+		return false;
+	if (num_srcs[opcode] >= 3U &&
+		!xlate_src(x,
+				   bit_select(p[2], 21, 3),
+				   bit_select(p[2], 16, 5),
+				   bit_select(p[2], 0, 16),
+				   &srcs[2]))
+		return false;
+	switch (opcode) {
+		case 5U: /* DP2ADD */
+			srcs[2] = replicate(srcs[2]);
+			break;
+		case 9U: /* RCP */
+		case 10U: /* RSQ */
+		case 11U: /* EXP */
+		case 12U: /* LOG */
+			srcs[0] = replicate(srcs[0]);
+			break;
+		case 16U: /* FLR: src - frc(src) */
+			t = alloc_scratch(x);
+			if (t == NO_REG)
+				return false;
+			emit_op(x, D3DSIO_FRC, scratch_dst(t), 1U, &srcs[0]);
+			ops[0] = srcs[0];
+			ops[1] = negate(scratch_src(t));
+			emit_op(x, D3DSIO_ADD, dst, 2U, &ops[0]);
+			goto done;
+		case 17U: /* MOD */
+			if (!emit_mod(x, dst, srcs[0]))
+				return false;
+			goto done;
+		case 18U: /* TRC: src - mod(src) */
+			t = alloc_scratch(x);
+			if (t == NO_REG ||
+				!emit_mod(x, scratch_dst(t), srcs[0]))
+				return false;
+			ops[0] = srcs[0];
+			ops[1] = negate(scratch_src(t));
+			emit_op(x, D3DSIO_ADD, dst, 2U, &ops[0]);
+			goto done;
+		case 19U: /* SGE */
+		case 20U: /* SLT */
+			t = alloc_scratch(x);
+			if (t == NO_REG)
+				return false;
+			ops[0] = srcs[0];
+			ops[1] = negate(srcs[1]);
+			emit_op(x, D3DSIO_ADD, scratch_dst(t), 2U, &ops[0]);
+			ops[0] = scratch_src(t);
+			ops[1] = d3d_reg(D3DSPR_CONST, x->const_reg) | ((opcode == 19U ? 0x55U : 0x00U) << 16);
+			ops[2] = d3d_reg(D3DSPR_CONST, x->const_reg) | ((opcode == 19U ? 0x00U : 0x55U) << 16);
+			x->need_const = true;
+			emit_op(x, D3DSIO_CMP, dst, 3U, &ops[0]);
+			goto done;
+		default:
+			if (opcode >= sizeof d3d_opcodes / sizeof d3d_opcodes[0])
+				return false;
+			break;
+	}
+	emit_op(x, d3d_opcodes[opcode], dst, num_srcs[opcode], &srcs[0]);
+done:
+	free_scratch(x);
+	return true;
+}
+
+static
+bool xlate_texture(Translation* x, uint32_t const* p)
+{
+	uint32_t opcode = p[0] >> 24, dst, coord, type, nr, sampler;
+	uint8_t t;
+
+	type = bit_select(p[1], 24, 3);
+	nr = bit_select(p[1], 17, 5);
+	if (!map_reg(x, type, nr, &coord))
+		return false;
+	/*
+	 * ps_2_0 takes texture coordinates from t# or r# only
+	 */
+	if (((coord >> 28) & 7U) != D3DSPR_TEMP &&
+		((coord >> 28) & 7U) != D3DSPR_TEXTURE) {
+		t = alloc_scratch(x);
+		if (t == NO_REG)
+			return false;
+		emit(x, d3d_inst(D3DSIO_MOV, 2U));
+		emit(x, scratch_dst(t));
+		emit(x, coord | (D3DSP_SWIZZLE_ID << 16));
+		coord = d3d_reg(D3DSPR_TEMP, t);
+	}
+	if (opcode == 24U) { /* TEXKILL */
+		emit(x, d3d_inst(D3DSIO_TEXKILL, 1U));
+		emit(x, coord | (15U << 16));
+		goto done;
+	}
+	sampler = bit_select(p[0], 0, 4);
+	if (type == I915_REG_TYPE_T && nr < 8U) {
+		x->tc2s_map = (x->tc2s_map & ~(15U << (4U * nr))) | (sampler << (4U * nr));
+		x->tc2s_map_valids |= (1U << nr);
+	}
+	if (!map_reg(x, bit_select(p[0], 19, 3), bit_select(p[0], 14, 5), &dst) ||
+		((dst >> 28) & 7U) != D3DSPR_TEMP)
+		return false;
+	emit(x, d3d_inst(D3DSIO_TEX, 3U, opcode - 21U));	// texld, texldp, texldb
+	emit(x, dst | (15U << 16));
+	emit(x, coord | (D3DSP_SWIZZLE_ID << 16));
+	emit(x, d3d_reg(D3DSPR_SAMPLER, sampler) | (D3DSP_SWIZZLE_ID << 16));
+done:
+	free_scratch(x);
+	return true;
+}
+
+static
+bool xlate_dcl(uint32_t* out, size_t* len, uint32_t const* p)
+{
+	uint32_t nr = bit_select(p[0], 14, 5), mask = bit_select(p[0], 10, 4);
+
+	switch (bit_select(p[0], 19, 3)) {
+		case I915_REG_TYPE_T:
+			out[(*len)++] = d3d_inst(D3DSIO_DCL, 2U);
+			out[(*len)++] = 0x80000000U;
+			if (nr < 8U)
+				out[(*len)++] = d3d_reg(D3DSPR_TEXTURE, nr) | (mask << 16);
+			else if (nr == I915_T_DIFFUSE)
+				out[(*len)++] = d3d_reg(D3DSPR_INPUT, 0U) | (mask << 16);
+			else if (nr == I915_T_SPECULAR)
+				out[(*len)++] = d3d_reg(D3DSPR_INPUT, 1U) | (mask << 16);
+			else
+				return false;
+			return true;
+		case I915_REG_TYPE_S:
+			if (nr >= 16U)
+				return false;
+			out[(*len)++] = d3d_inst(D3DSIO_DCL, 2U);
+			/*
+			 * 2D, CUBE, VOLUME
+			 */
+			out[(*len)++] = 0x80000000U | ((bit_select(p[0], 22, 2) + 2U) << 27);
+			out[(*len)++] = d3d_reg(D3DSPR_SAMPLER, nr) | (15U << 16);
+			return true;
+	}
+	return true;
+}
+
+#pragma mark -
+#pragma mark Global Functions
+#pragma mark -
+
+HIDDEN
+IOReturn translate_i915_program(uint32_t const* source,
+								uint32_t num_dwords,
+								uint32_t** bytecode,
+								uint32_t* bytecode_len,
+								uint32_t* tc2s_map,
+								uint8_t* tc2s_map_valids)
+{
+	Translation x;
+	uint32_t const* p;
+	uint32_t *head, *out, i, num_inst = num_dwords / 3U, consts_used = 0U, opcode;
+	size_t head_len = 0U, head_max, body_max, len;
+	IOReturn rc = kIOReturnUnsupported;
+
+	if (!source || !num_inst || num_inst > I915_MAX_PS_INSTRUCTIONS ||
+		!bytecode || !bytecode_len || !tc2s_map || !tc2s_map_valids)
+		return kIOReturnBadArgument;
+	bzero(&x, sizeof x);
+	memset(&x.rmap[0], NO_REG, sizeof x.rmap);
+	x.free_temps = (1U << PS_2_0_MAX_TEMPS) - 1U;
+	x.oc_temp = NO_REG;
+	x.od_temp = NO_REG;
+	x.tc2s_map = 0xFFFFFFFFU;
+	/*
+	 * Worst case is 4 gathering movs per source plus 3 instructions
+	 */
+	head_max = 3U * num_inst + 8U;
+	body_max = 64U * num_inst + 8U;
+	head = static_cast<uint32_t*>(IOMalloc((head_max + body_max) * sizeof(uint32_t)));
+	if (!head)
+		return kIOReturnNoMemory;
+	x.body = head + head_max;
+	/*
+	 * First pass: declarations, and find a free constant for { 0, 1 }
+	 */
+	for (i = 0U, p = source; i != num_inst; ++i, p += 3) {
+		opcode = p[0] >> 24;
+		if (opcode == 25U) {
+			if (!xlate_dcl(head, &head_len, p))
+				goto cleanup;
+			continue;
+		}
+		if (opcode > 24U)
+			continue;
+		if (opcode > 20U) {	/* texture, the coordinate may be a constant */
+			if (bit_select(p[1], 24, 3) == I915_REG_TYPE_CONST)
+				consts_used |= (1U << bit_select(p[1], 17, 5));
+			continue;
+		}
+		if (bit_select(p[0], 7, 3) == I915_REG_TYPE_CONST)
+			consts_used |= (1U << bit_select(p[0], 2, 5));
+		if (bit_select(p[1], 13, 3) == I915_REG_TYPE_CONST)
+			consts_used |= (1U << bit_select(p[1], 8, 5));
+		if (bit_select(p[2], 21, 3) == I915_REG_TYPE_CONST)
+			consts_used |= (1U << bit_select(p[2], 16, 5));
+	}
+	if (consts_used == 0xFFFFFFFFU)
+		x.const_reg = NO_REG;
+	else
+		x.const_reg = static_cast<uint8_t>(31 - __builtin_clz(~consts_used));
+	/*
+	 * Second pass: instructions
+	 */
+	for (i = 0U, p = source; i != num_inst; ++i, p += 3) {
+		opcode = p[0] >> 24;
+		if (opcode <= 20U) {
+			if (!xlate_arith(&x, p))
+				goto cleanup;
+		} else if (opcode <= 24U) {
+			if (!xlate_texture(&x, p))
+				goto cleanup;
+		} else if (opcode != 25U)
+			goto cleanup;
+		if (x.need_const && x.const_reg == NO_REG)
+			goto cleanup;
+	}
+	if (x.oc_temp == NO_REG)
+		goto cleanup;
+	emit(&x, d3d_inst(D3DSIO_MOV, 2U));
+	emit(&x, d3d_reg(D3DSPR_COLOROUT, 0U) | (15U << 16));
+	emit(&x, scratch_src(x.oc_temp));
+	if (x.od_temp != NO_REG) {
+		emit(&x, d3d_inst(D3DSIO_MOV, 2U));
+		emit(&x, d3d_reg(D3DSPR_DEPTHOUT, 0U) | (15U << 16));
+		emit(&x, d3d_reg(D3DSPR_TEMP, x.od_temp) | (0xAAU << 16));	// .zzzz
+	}
+	/*
+	 * Assemble version, declarations, definition, body, end
+	 */
+	len = 1U + head_len + (x.need_const ? 6U : 0U) + x.body_len + 1U;
+	out = static_cast<uint32_t*>(IOMalloc(len * sizeof(uint32_t)));
+	if (!out) {
+		rc = kIOReturnNoMemory;
+		goto cleanup;
+	}
+	*bytecode = out;
+	*out++ = PS_2_0_VERSION;
+	memcpy(out, head, head_len * sizeof(uint32_t));
+	out += head_len;
+	if (x.need_const) {
+		*out++ = d3d_inst(D3DSIO_DEF, 5U);
+		*out++ = d3d_reg(D3DSPR_CONST, x.const_reg) | (15U << 16);
+		*out++ = 0U;			// 0.0F
+		*out++ = 0x3F800000U;	// 1.0F
+		*out++ = 0U;
+		*out++ = 0U;
+	}
+	memcpy(out, x.body, x.body_len * sizeof(uint32_t));
+	out += x.body_len;
+	*out = D3DSIO_END;
+	*bytecode_len = static_cast<uint32_t>(len * sizeof(uint32_t));
+	*tc2s_map = x.tc2s_map;
+	*tc2s_map_valids = x.tc2s_map_valids;
+	rc = kIOReturnSuccess;
+cleanup:
+	IOFree(head, (head_max + body_max) * sizeof(uint32_t));
+	return rc;
+}
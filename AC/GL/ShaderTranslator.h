@@ -0,0 +1,38 @@
+/*
+
+    CEsvga2 - ChrisEric1 Super Video Graphics Array 2
+    Copyright (C) 2023-2024, Christopher Eric Lentocha
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published
+    by the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef __SHADERTRANSLATOR_H__
+#define __SHADERTRANSLATOR_H__
+
+#define I915_MAX_PS_INSTRUCTIONS 123U
+
+/*
+ * Translates an i915 fragment program into SVGA3D ps_2_0 bytecode.
+ *   On success, *bytecode is allocated with IOMalloc and must be
+ *   freed with IOFree(*bytecode, *bytecode_len).
+ */
+IOReturn translate_i915_program(uint32_t const* source,
+								uint32_t num_dwords,
+								uint32_t** bytecode,
+								uint32_t* bytecode_len,
+								uint32_t* tc2s_map,
+								uint8_t* tc2s_map_valids);
+
+#endif /* __SHADERTRANSLATOR_H__ */
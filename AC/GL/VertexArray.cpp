@@ -41,13 +41,42 @@ bool isIdValid(uint32_t id)
 	return static_cast<int>(id) >= 0;
 }
 
+#pragma mark -
+#pragma mark Private Methods
+#pragma mark -
+
+/*
+ * Inserts a new segment into the ring at index
+ */
+HIDDEN
+bool CLASS::add_segment(CEsvga2Accel* provider, size_t index)
+{
+	uint8_t* p;
+	size_t i;
+
+	if (num_segments >= VERTEX_ARRAY_MAX_SEGMENTS)
+		return false;
+	p = static_cast<uint8_t*>(provider->VRAMMalloc(segment_bytes, CEsvga2Accel::kVRAMTagVertexArray));
+	if (!p)
+		return false;
+	for (i = num_segments; i > index; --i)
+		segments[i] = segments[i - 1U];
+	segments[index].kernel_ptr = p;
+	segments[index].offset_in_gmr = provider->offsetInVRAM(p);
+	segments[index].fence = 0U;
+	++num_segments;
+	return true;
+}
+
 #pragma mark -
 #pragma mark Public Methods
 #pragma mark -
 
 HIDDEN
-void CLASS::init(void)
+void CLASS::init(uint32_t surface_hint)
 {
+	num_segments = 0U;
+	hint = surface_hint;
 	sid = SVGA_ID_INVALID;
 	gmr_id = SVGA_ID_INVALID;
 }
@@ -55,20 +84,21 @@ void CLASS::init(void)
 HIDDEN
 void CLASS::purge(CEsvga2Accel* provider)
 {
+	size_t i;
+
 	if (!provider)
 		return;
-	if (fence) {
-		provider->SyncToFence(fence);
-		fence = 0U;
-	}
+	for (i = 0U; i != num_segments; ++i)
+		if (segments[i].fence)
+			provider->SyncToFence(segments[i].fence);
 	gmr_id = SVGA_ID_INVALID;
-	if (kernel_ptr) {
-		provider->VRAMFree(kernel_ptr);
-		kernel_ptr = 0;
-		size_bytes = 0U;
-		offset_in_gmr = 0U;
-		next_avail = 0U;
-	}
+	for (i = 0U; i != num_segments; ++i)
+		provider->VRAMFree(segments[i].kernel_ptr, CEsvga2Accel::kVRAMTagVertexArray);
+	bzero(&segments[0], sizeof segments);
+	num_segments = 0U;
+	segment_bytes = 0U;
+	current = 0U;
+	next_avail = 0U;
 	if (isIdValid(sid)) {
 		provider->destroySurface(sid);
 		provider->FreeSurfaceID(sid);
@@ -79,70 +109,105 @@ void CLASS::purge(CEsvga2Accel* provider)
 HIDDEN
 IOReturn CLASS::alloc(CEsvga2Accel* provider, size_t num_bytes, uint8_t** ptr)
 {
-	size_t alloc_bytes;
+	size_t next;
 	IOReturn rc;
 
 	if (!provider)
 		return kIOReturnNotReady;
 	num_bytes = (num_bytes + sizeof(uint32_t) - 1U) & -sizeof(uint32_t);
-	if (kernel_ptr) {
-		if (next_avail + num_bytes <= size_bytes)
+	if (num_segments && num_bytes <= segment_bytes) {
+		if (next_avail + num_bytes <= segment_bytes)
 			goto done;
-		if (num_bytes <= size_bytes) {
-			if (fence) {
-				provider->SyncToFence(fence);
-				fence = 0U;
-			}
-			next_avail = 0U;
-			goto done;
-		}
-		purge(provider);
+		next = current + 1U;
+		if (next == num_segments)
+			next = 0U;
+		/*
+		 * If the oldest segment is still in use by the host,
+		 *   grow the ring rather than wait for it.
+		 */
+		if (!provider->HasFencePassed(segments[next].fence) &&
+			add_segment(provider, current + 1U))
+			next = current + 1U;
+		else if (segments[next].fence)
+			provider->SyncToFence(segments[next].fence);
+		segments[next].fence = 0U;
+		current = next;
+		next_avail = 0U;
+		goto done;
 	}
-	alloc_bytes = (num_bytes + PAGE_MASK) & -PAGE_SIZE;
+	purge(provider);
+	segment_bytes = (num_bytes + PAGE_MASK) & -PAGE_SIZE;
+	if (segment_bytes < VERTEX_ARRAY_SEGMENT_BYTES)
+		segment_bytes = VERTEX_ARRAY_SEGMENT_BYTES;
 	sid = provider->AllocSurfaceID();
 	rc = provider->createSurface(sid,
-								 SVGA3dSurfaceFlags(SVGA3D_SURFACE_HINT_VERTEXBUFFER |
+								 SVGA3dSurfaceFlags(hint |
 													SVGA3D_SURFACE_HINT_DYNAMIC |
 													SVGA3D_SURFACE_HINT_WRITEONLY),
 								 SVGA3D_BUFFER,
-								 static_cast<uint32_t>(alloc_bytes),
+								 static_cast<uint32_t>(segment_bytes),
 								 1U);
 	if (rc != kIOReturnSuccess) {
 		provider->FreeSurfaceID(sid);
 		sid = SVGA_ID_INVALID;
 		return rc;
 	}
-	kernel_ptr = static_cast<uint8_t*>(provider->VRAMMalloc(alloc_bytes));
-	if (!kernel_ptr) {
+	if (!add_segment(provider, 0U)) {
 		purge(provider);
 		return kIOReturnNoMemory;
 	}
-	size_bytes = alloc_bytes;
-	offset_in_gmr = provider->offsetInVRAM(kernel_ptr);
+	current = 0U;
+	next_avail = 0U;
 	gmr_id = GMR_VRAM();
 done:
-	*ptr = kernel_ptr + next_avail;
+	*ptr = segments[current].kernel_ptr + next_avail;
 	next_avail += num_bytes;
 	return kIOReturnSuccess;
 }
 
+/*
+ * Bytes that alloc can still hand out contiguously
+ *   without leaving the current segment
+ */
+HIDDEN
+size_t CLASS::avail(void) const
+{
+	return num_segments ? segment_bytes - next_avail : 0U;
+}
+
 HIDDEN
 IOReturn CLASS::upload(CEsvga2Accel* provider, uint8_t const* ptr, size_t num_bytes, uint32_t* _sid)
+{
+	if (_sid)
+		*_sid = sid;
+	return upload_to(provider, ptr, num_bytes, sid);
+}
+
+/*
+ * Copies num_bytes at ptr, obtained from alloc, to the start
+ *   of another buffer surface instead of the array's own
+ */
+HIDDEN
+IOReturn CLASS::upload_to(CEsvga2Accel* provider, uint8_t const* ptr, size_t num_bytes, uint32_t dest_sid)
 {
 	SVGA3dSurfaceImageId hostImage;
 	SVGA3dCopyBox copyBox;
 	CEsvga2Accel::ExtraInfoEx extra;
-	size_t additional_offset;
+	size_t additional_offset, i;
 
 	if (!provider)
 		return kIOReturnNotReady;
-	if (ptr < kernel_ptr)
+	for (i = 0U; i != num_segments; ++i)
+		if (ptr >= segments[i].kernel_ptr &&
+			ptr < segments[i].kernel_ptr + segment_bytes)
+			break;
+	if (i == num_segments)
 		return kIOReturnUnderrun;
-	additional_offset = ptr - kernel_ptr;
-	if (additional_offset + num_bytes > size_bytes)
+	additional_offset = ptr - segments[i].kernel_ptr;
+	if (additional_offset + num_bytes > segment_bytes)
 		return kIOReturnOverrun;
 	extra.mem_gmr_id = gmr_id;
-	extra.mem_offset_in_gmr = offset_in_gmr + additional_offset;
+	extra.mem_offset_in_gmr = segments[i].offset_in_gmr + additional_offset;
 	extra.mem_pitch = 0U;
 	extra.mem_limit = num_bytes;
 	extra.suffix_flags = 3U;
@@ -150,14 +215,12 @@ IOReturn CLASS::upload(CEsvga2Accel* provider, uint8_t const* ptr, size_t num_by
 	copyBox.w = static_cast<uint32_t>(num_bytes);
 	copyBox.h = 1U;
 	copyBox.d = 1U;
-	hostImage.sid = sid;
-	if (_sid)
-		*_sid = sid;
+	hostImage.sid = dest_sid;
 	hostImage.face = 0U;
 	hostImage.mipmap = 0U;
 	return provider->surfaceDMA3DEx(&hostImage,
 									SVGA3D_WRITE_HOST_VRAM,
 									&copyBox,
 									&extra,
-									&fence);
+									&segments[i].fence);
 }
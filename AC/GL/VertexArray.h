@@ -21,21 +21,38 @@
 #ifndef __VERTEXARRAY_H__
 #define __VERTEXARRAY_H__
 
+#define VERTEX_ARRAY_MAX_SEGMENTS	8U
+#define VERTEX_ARRAY_SEGMENT_BYTES	(16U * PAGE_SIZE)
+
 class VertexArray
 {
-	uint8_t* kernel_ptr;
-	size_t size_bytes;
-	size_t offset_in_gmr;
+	/*
+	 * The array is a ring of segments, each tagged with
+	 *   the fence of the last upload from it
+	 */
+	struct Segment {
+		uint8_t* kernel_ptr;
+		size_t offset_in_gmr;
+		uint32_t fence;
+	};
+	Segment segments[VERTEX_ARRAY_MAX_SEGMENTS];
+	size_t num_segments;
+	size_t segment_bytes;
+	size_t current;
 	size_t next_avail;
 	uint32_t sid;
 	uint32_t gmr_id;
-	uint32_t fence;
+	uint32_t hint;	// SVGA3D_SURFACE_HINT_VERTEXBUFFER or _INDEXBUFFER
+
+	bool add_segment(class CEsvga2Accel* provider, size_t index);
 
 public:
-	void init(void);
+	void init(uint32_t surface_hint);
 	void purge(class CEsvga2Accel* provider);
 	IOReturn alloc(class CEsvga2Accel* provider, size_t num_bytes, uint8_t** ptr);
+	size_t avail(void) const;
 	IOReturn upload(class CEsvga2Accel* provider, uint8_t const* ptr, size_t num_bytes, uint32_t* sid);
+	IOReturn upload_to(class CEsvga2Accel* provider, uint8_t const* ptr, size_t num_bytes, uint32_t dest_sid);
 };
 
 #endif /* __VERTEXARRAY_H__ */
@@ -466,6 +466,22 @@ bool CLASS::SurfaceStretchBlt(SVGA3dSurfaceImageId const* src,   // IN
 	return true;
 }
 
+/*
+ * Rebuilds mipmap levels 1 and up of every face from level 0
+ */
+bool CLASS::GenerateMipmaps(uint32_t sid,                 // IN
+							SVGA3dTextureFilter filter)   // IN
+{
+	SVGA3dCmdGenerateMipmaps *cmd;
+	cmd = static_cast<SVGA3dCmdGenerateMipmaps*>(FIFOReserve(SVGA_3D_CMD_GENERATE_MIPMAPS, sizeof *cmd));
+	if (!cmd)
+		return false;
+	cmd->sid = sid;
+	cmd->filter = filter;
+	m_svga->FIFOCommitAll();
+	return true;
+}
+
 bool CLASS::SetViewport(uint32_t cid,        // IN
 						SVGA3dRect const* rect)  // IN
 {
@@ -110,6 +110,7 @@ public:
 						   SVGA3dSurfaceImageId const* dest,
 						   SVGA3dBox const* boxSrc, SVGA3dBox const* boxDest,
 						   SVGA3dStretchBltMode mode);
+	bool GenerateMipmaps(uint32_t sid, SVGA3dTextureFilter filter);
 
 	/*
 	 * Shared FFP/Shader Render State
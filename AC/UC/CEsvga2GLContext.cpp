@@ -136,7 +136,11 @@ void blitGarbageToScreen(CEsvga2Accel* m_provider, size_t offset_in_vram, uint32
 HIDDEN
 void CLASS::Init()
 {
+	size_t i;
+
 	m_command_buffer.xfer.init();
+	for (i = 0U; i != GL_COMMAND_BUFFERS_MAX - 1U; ++i)
+		m_command_ring[i].xfer.init();
 	m_context_buffer0.xfer.init();
 	m_context_buffer1.xfer.init();
 }
@@ -144,7 +148,14 @@ void CLASS::Init()
 HIDDEN
 void CLASS::Cleanup()
 {
+	size_t i;
+
 	if (m_ipp) {
+		if (m_shared) {
+			m_shared->lockShared();
+			m_ipp->set_vertex_buffer(0, 0U, 0U);	// drops its reference
+			m_shared->unlockShared();
+		}
 		m_ipp->stop();
 		m_ipp->release();
 		m_ipp = 0;
@@ -166,6 +177,12 @@ void CLASS::Cleanup()
 	}
 	m_command_buffer.xfer.complete(m_provider);
 	m_command_buffer.xfer.discard();
+	for (i = 0U; i != m_command_ring_len; ++i) {
+		m_command_ring[i].xfer.complete(m_provider);
+		m_command_ring[i].xfer.discard();
+	}
+	m_command_ring_len = 0U;
+	m_command_ring_next = 0U;
 	m_context_buffer0.xfer.discard();
 	m_context_buffer1.xfer.discard();
 	if (m_fences) {
@@ -199,6 +216,29 @@ bool CLASS::allocCommandBuffer(CEsvga2CommandBuffer* buffer, size_t size)
 	return true;
 }
 
+/*
+ * Parks the command buffer just submitted, and makes the oldest
+ *   parked one current.  Only waits if the host is still reading
+ *   that one, rather than on the buffer just submitted.
+ */
+HIDDEN
+void CLASS::rotateCommandBuffer()
+{
+	CEsvga2CommandBuffer parked;
+	uint32_t stamp;
+
+	if (m_command_ring_len) {
+		stamp = m_command_buffer.submit_stamp;
+		parked = m_command_buffer;
+		m_command_buffer = m_command_ring[m_command_ring_next];
+		m_command_ring[m_command_ring_next] = parked;
+		if (++m_command_ring_next == m_command_ring_len)
+			m_command_ring_next = 0U;
+		m_command_buffer.submit_stamp = stamp;	// for finish()
+	}
+	m_command_buffer.xfer.complete(m_provider);
+}
+
 HIDDEN
 void CLASS::initCommandBufferHeader(VendorCommandBufferHeader* buffer_ptr, size_t size)
 {
@@ -336,12 +376,15 @@ IOReturn CLASS::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemory
 			if (!m_shared || !m_ipp)
 				return kIOReturnNotReady;
 			m_shared->lockShared();
+			m_shared->retireTextureUploads();
+			m_texture_epoch = m_shared->getTextureClock();
 #if 1
 			for (d = 0U; d != 21U; ++d)
 				if (m_txs[i])
 					addTextureToStream(m_txs[i]);
 #endif
 			pcbRet = processCommandBuffer(&result);
+			flush_tex_subimage_2d();
 			if (m_stream_error) {
 				m_shared->unlockShared();
 				*options = m_stream_error;
@@ -353,16 +396,28 @@ IOReturn CLASS::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemory
 				if (m_txs[d])
 					removeTextureFromStream(m_txs[d]);
 #endif
-			m_shared->unlockShared();
+			/*
+			 * The batch refers to texture surfaces by id, so submit it
+			 *   before another context sharing them can evict any
+			 */
+			m_command_buffer.submit_stamp = 0U;
 			if (result.ds_count_dwords)
+				m_command_buffer.submit_stamp =
 				m_ipp->submit_buffer(result.next, result.ds_count_dwords);
+			/*
+			 * A buffer with no batch may still have queued DMAs, and a
+			 *   batch may have gone unfenced.  Fence all of it for finish().
+			 */
+			if (!m_command_buffer.submit_stamp)
+				m_command_buffer.submit_stamp = m_provider->InsertFence();
+			m_shared->unlockShared();
 			if (pcbRet & 2U) {
 				if (m_fbo[0])
 					touchDrawFBO();
 				if (m_surface_client)
 					m_surface_client->touchRenderTarget();
 			}
-			m_command_buffer.xfer.complete(m_provider);
+			rotateCommandBuffer();
 			lockAccel(m_provider);
 			/*
 			 * AB58: reinitialize buffer
@@ -378,7 +433,7 @@ IOReturn CLASS::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemory
 			p->flags = pcbRet /* var_88 */;
 			p->downstream[-1] = 1;
 			p->downstream[0] = 1U << 24;	// terminating token
-			p->stamp = 0 /* this->0x7C */;
+			p->stamp = m_command_buffer.submit_stamp;	// fence of the batch just submitted
 			unlockAccel(m_provider);
 #if 1
 			sleepForSwapCompleteNoLock(var_84);
@@ -537,6 +592,17 @@ bool CLASS::start(IOService* provider)
 	}
 	m_command_buffer.kernel_ptr->flags = 2U;
 	m_command_buffer.kernel_ptr->downstream[1] = 1U << 24;
+	/*
+	 * Fewer buffers only means less pipelining, so don't fail
+	 */
+	for (m_command_ring_len = 0U;
+		 m_command_ring_len + 1U < m_provider->getGLCommandBuffers();
+		 ++m_command_ring_len)
+		if (!allocCommandBuffer(&m_command_ring[m_command_ring_len], 0x10000U)) {
+			GLLog(1, "%s: allocCommandBuffer failed for ring buffer %u\n", __FUNCTION__, m_command_ring_len);
+			m_command_ring[m_command_ring_len].xfer.discard();
+			break;
+		}
 	return true;
 
 bad:
@@ -759,6 +825,7 @@ HIDDEN
 IOReturn CLASS::read_buffer(struct sIOGLContextReadBufferData const* struct_in, size_t struct_in_size)
 {
 	IOReturn rc;
+	uint32_t bytes_per_pixel;
 	VendorTransferBuffer xfer;
 	SVGA3dSurfaceImageId hostImage;
 	SVGA3dCopyBox copyBox;
@@ -808,19 +875,52 @@ IOReturn CLASS::read_buffer(struct sIOGLContextReadBufferData const* struct_in,
 #endif
 	/*
 	 * Known data types
+	 *   0U - color buffer (selector 1)
+	 *   1U - color buffer (selector 0)
 	 *   4U - depth buffer
+	 * Note: The surface has a single color buffer, and which of the
+	 *   two selectors is front or back hasn't been verified, so only
+	 *   data type 0 is read.  Type 1 is left unsupported like the rest.
 	 */
 	if (!m_surface_client)	// Note: Apple's code doesn't implement read_buffer on a ReadFBO (!)
 		return kIOReturnCannotLock;
-	if (struct_in->data_type != 4U)
-		return kIOReturnSuccess /* kIOReturnUnsupported */;
 	bzero(&hostImage, sizeof hostImage);
-	if (!m_surface_client->getSurfacesForGL(0, &hostImage.sid))
-		return kIOReturnCannotLock;
+	switch (struct_in->data_type) {
+		case 0U:
+			if (!m_surface_client->getSurfacesForGL(&hostImage.sid, 0))
+				return kIOReturnCannotLock;
+			bytes_per_pixel = m_surface_client->getBytesPerPixel();
+			break;
+		case 4U:
+			if (!m_surface_client->getSurfacesForGL(0, &hostImage.sid))
+				return kIOReturnCannotLock;
+			switch (m_surface_client->getDepthStencilFormat()) {
+				case SVGA3D_Z_D16:
+				case SVGA3D_Z_D15S1:
+					bytes_per_pixel = sizeof(uint16_t);
+					break;
+				default:
+					bytes_per_pixel = sizeof(uint32_t);
+					break;
+			}
+			break;
+		default:
+			return kIOReturnSuccess /* kIOReturnUnsupported */;
+	}
 	if (!isIdValid(hostImage.sid))
 		return kIOReturnNotAttached;
-	bzero(&xfer, sizeof xfer);
-	xfer.init();
+	if (!struct_in->width || !struct_in->height)
+		return kIOReturnSuccess;
+	/*
+	 * The DMA copies the surface's pixels as they are, with no
+	 *   format or type conversion, so only accept a request whose
+	 *   pitch can hold a row of them.
+	 */
+	if (static_cast<uint64_t>(struct_in->width) * bytes_per_pixel > struct_in->pitch) {
+		GLLog(1, "%s: pitch %u too small for %u pixels of %u bytes\n", __FUNCTION__,
+			  struct_in->pitch, struct_in->width, bytes_per_pixel);
+		return kIOReturnUnsupported;
+	}
 	bzero(&copyBox, sizeof copyBox);
 	copyBox.x = struct_in->x;
 	copyBox.y = struct_in->y;
@@ -832,11 +932,16 @@ IOReturn CLASS::read_buffer(struct sIOGLContextReadBufferData const* struct_in,
 	extra.mem_limit = 0xFFFFFFFFU;
 	extra.suffix_flags = 2U;
 	/*
+	 * The client's buffer is usually allocated per call, so its pages
+	 *   are wired only for the DMA, and its GMR isn't cached (see
+	 *   CEsvga2Accel::acquireGMR).
 	 * Note: should check that address doesn't refer to a read-only region,
 	 *   but Apple's code doesn't do this.
 	 */
-	xfer.md = IOMemoryDescriptor::withAddressRange(struct_in->addr,
-												   struct_in->height * struct_in->pitch,
+	bzero(&xfer, sizeof xfer);
+	xfer.init();
+	xfer.md = IOMemoryDescriptor::withAddressRange(struct_in->addr & ~static_cast<mach_vm_address_t>(page_mask),
+												   static_cast<IOByteCount>(extra.mem_offset_in_gmr + struct_in->height * struct_in->pitch),
 												   kIODirectionInOut,
 												   m_owning_task);
 	if (!xfer.md)
@@ -852,6 +957,10 @@ IOReturn CLASS::read_buffer(struct sIOGLContextReadBufferData const* struct_in,
 									&copyBox,
 									&extra,
 									&xfer.fence);
+	/*
+	 * The client reads the pixels as soon as this returns,
+	 *   so wait for the DMA (complete syncs to its fence)
+	 */
 	xfer.complete(m_provider);
 	xfer.discard();
 	return rc;
@@ -860,10 +969,21 @@ IOReturn CLASS::read_buffer(struct sIOGLContextReadBufferData const* struct_in,
 HIDDEN
 IOReturn CLASS::finish()
 {
+	uint32_t fence;
+
 	GLLog(2, "%s()\n", __FUNCTION__);
-	if (m_provider)
+	if (!m_provider)
+		return kIOReturnSuccess;
+	/*
+	 * Wait for this context's last command buffer rather than the
+	 *   whole FIFO, unless there's no fence to wait on
+	 */
+	fence = m_command_buffer.submit_stamp;
+	if (!fence)
+		fence = m_provider->InsertFence();
+	if (!fence)
 		return m_provider->SyncFIFO();
-	return kIOReturnSuccess;
+	return m_provider->SyncToFence(fence);
 }
 
 HIDDEN
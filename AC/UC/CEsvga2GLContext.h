@@ -23,6 +23,8 @@
 
 #include <IOKit/IOUserClient.h>
 
+#define TEX_SUBIMAGE_MAX_BOXES 32U
+
 struct VendorCommandBufferHeader;
 struct VendorGLStreamInfo;
 struct CEsvga2TextureBuffer;
@@ -78,6 +80,38 @@ private:
 	 * Intel Pipeline processor
 	 */
 	class CEsvga2IPP* m_ipp;
+	/*
+	 * TexSubImage2D boxes for one texture image, sent
+	 *   to the host as a single surface DMA
+	 */
+	struct {
+		CEsvga2TextureBuffer* tx;
+		SVGA3dSurfaceImageId hostImage;
+		CEsvga2Accel::ExtraInfoEx extra;
+		uint32_t num_boxes;
+		SVGA3dCopyBox boxes[TEX_SUBIMAGE_MAX_BOXES];
+	} m_tex_subimage;
+	uint32_t m_texture_epoch;				// texture clock at start of command buffer
+	/*
+	 * Destination of CopyPixelsSrc[FBO], from CopyPixelsDst
+	 */
+	struct {
+		uint32_t object_id;
+		uint16_t x;
+		uint16_t y;
+		uint8_t face;
+		uint8_t mipmap;
+		bool valid;
+	} m_copy_dst;
+	/*
+	 * Command buffers already submitted, whose pages the host
+	 *   may still be reading.  The client is handed the oldest
+	 *   in turn, so it fills one while the host works through
+	 *   the others.
+	 */
+	CEsvga2CommandBuffer m_command_ring[GL_COMMAND_BUFFERS_MAX - 1U];
+	uint32_t m_command_ring_len;
+	uint32_t m_command_ring_next;
 
 	/*
 	 * Private Methods
@@ -85,6 +119,7 @@ private:
 	void Init();
 	void Cleanup();
 	static bool allocCommandBuffer(CEsvga2CommandBuffer*, size_t);
+	void rotateCommandBuffer();
 	static void initCommandBufferHeader(VendorCommandBufferHeader*, size_t);
 	bool allocAllContextBuffers();
 	static IOReturn get_status(uint32_t*);
@@ -107,7 +142,10 @@ private:
 	IOReturn alloc_and_load_texture(CEsvga2TextureBuffer*);
 	IOReturn tex_subimage_2d(CEsvga2TextureBuffer* tx,
 							 struct GLDTexSubImage2DStruc const* desc);
+	void flush_tex_subimage_2d(void);
 	void setup_drawbuffer_registers(uint32_t*);
+	bool get_read_image(SVGA3dSurfaceImageId* image, int* surface_format);
+	void copy_pixels(SVGA3dSurfaceImageId const* srcImage, int src_format, uint32_t src_xy, uint32_t size);
 
 public:
 	/*
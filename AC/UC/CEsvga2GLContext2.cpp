@@ -26,6 +26,7 @@
 #include "GLCommon.h"
 #include "UCGLDCommonTypes.h"
 #include "VLog.h"
+#include "ce1_options_ac.h"
 #include "CEsvga2Accel.h"
 #include "CEsvga2GLContext.h"
 #include "CEsvga2IPP.h"
@@ -265,6 +266,37 @@ bool areAnyPagedOff(GLDSysObject* sys_obj)
 	return false;
 }
 
+/*
+ * With host mipmaps, only level 0 of each face is loaded and
+ *   the host generates the rest.  Applies when every level is
+ *   defined and level 0 of every face is being reloaded.
+ *   Note: assumes the client's levels are box-filtered from
+ *   level 0, so it is opt-in (-ce1_host_mipmaps).
+ */
+static
+bool use_host_mipmaps(CEsvga2Accel* provider, CEsvga2TextureBuffer const* tx, GLDTextureHeader const* headers)
+{
+	uint8_t face, mipmap;
+
+	if (!checkOptionAC(CE1_OPTION_AC_HOST_MIPMAPS) ||
+		tx->num_mipmaps < 2U ||
+		!provider->getDevCap(SVGA3D_DEVCAP_AUTOGENMIPMAPS))
+		return false;
+	switch (tx->surface_format) {
+		case SVGA3D_Z_D24S8:
+		case SVGA3D_Z_D16:
+			return false;
+	}
+	for (face = 0U; face != tx->num_faces; ++face, headers += 12) {
+		if (!isPagedOff(tx->sys_obj, face, 0U))
+			return false;
+		for (mipmap = 0U; mipmap != tx->num_mipmaps; ++mipmap)
+			if (!headers[mipmap].pixels_in_client)
+				return false;
+	}
+	return true;
+}
+
 static
 bool need_yuv_shadow(CEsvga2Accel* provider, int surface_format)
 {
@@ -452,6 +484,7 @@ uint32_t CLASS::processCommandBuffer(VendorCommandDescriptor* result)
 {
 	VendorGLStreamInfo cb_iter;
 	uint32_t upper, commands_processed;
+	dispatch_function_t process;
 
 	cb_iter.dso_bytes = 0U;
 	cb_iter.p = &m_command_buffer.kernel_ptr->downstream[-1];
@@ -472,9 +505,18 @@ uint32_t CLASS::processCommandBuffer(VendorCommandDescriptor* result)
 			upper >= 2U && upper < 32U)
 			++upper;
 		if (upper < dispatch_process_1_count)
-			(this->*dispatch_process_1[upper])(&cb_iter);
+			process = dispatch_process_1[upper];
 		else if (upper >= 32U && upper < 32U + dispatch_process_2_count)
-			(this->*dispatch_process_2[upper - 32U])(&cb_iter);
+			process = dispatch_process_2[upper - 32U];
+		else
+			process = 0;
+		/*
+		 * Only consecutive TexSubImage2D tokens are batched
+		 */
+		if (process != &CLASS::process_token_TexSubImage2D)
+			flush_tex_subimage_2d();
+		if (process)
+			(this->*process)(&cb_iter);
 		if (m_stream_error)
 			break;
 		++commands_processed;
@@ -586,6 +628,7 @@ HIDDEN
 void CLASS::submit_midbuffer(VendorGLStreamInfo* info)
 {
 	uint32_t wc = static_cast<uint32_t>(info->ds_count_dwords);
+	flush_tex_subimage_2d();
 	if (!wc)
 		return;
 	if (wc > 2U) {
@@ -614,6 +657,7 @@ void CLASS::get_texture(VendorGLStreamInfo* info, CEsvga2TextureBuffer* tx, bool
 #if 1
 	CEsvga2TextureBuffer* ltx;
 #endif
+	m_shared->touchTexture(tx);
 	if (tx->sys_obj->in_use) {
 		submit_midbuffer(info);
 		alloc_and_load_texture(tx);
@@ -734,7 +778,7 @@ HIDDEN
 IOReturn CLASS::create_host_surface_for_texture(CEsvga2TextureBuffer* tx)
 {
 	IOReturn rc;
-	uint32_t face, mipmap, surface_flags, surface_format;
+	uint32_t face, mipmap, surface_flags, surface_format, host_bytes;
 	bool yuv;
 	SVGA3D* svga3d;
 	SVGA3dSurfaceFace* faces;
@@ -764,6 +808,7 @@ IOReturn CLASS::create_host_surface_for_texture(CEsvga2TextureBuffer* tx)
 				tx->yuv_shadow = m_provider->AllocSurfaceID();	// Note: doesn't fail
 				GLLog(3, "%s: Using YUV Alternate for texture %u\n", __FUNCTION__, tx->sys_obj->object_id);
 			}
+			host_bytes = tx->width * tx->height * tx->depth * (yuv ? 4U + tx->bytespp : tx->bytespp);
 			svga3d = m_provider->lock3D();
 			if (!svga3d) {
 				GLLog(1, "%s: cannot lock device\n", __FUNCTION__);
@@ -819,6 +864,7 @@ IOReturn CLASS::create_host_surface_for_texture(CEsvga2TextureBuffer* tx)
 				goto clean1;
 			}
 			headers = reinterpret_cast<typeof headers>(mmap->getVirtualAddress()) + tx->min_mipmap;
+			host_bytes = 0U;
 			svga3d = m_provider->lock3D();
 			if (!svga3d) {
 				GLLog(1, "%s: cannot lock device\n", __FUNCTION__);
@@ -840,16 +886,39 @@ IOReturn CLASS::create_host_surface_for_texture(CEsvga2TextureBuffer* tx)
 					mipmaps->width  = gld_th->width_bytes / tx->bytespp;
 					mipmaps->height = gld_th->height;
 					mipmaps->depth  = gld_th->depth;
+					host_bytes += gld_th->width_bytes * gld_th->height * gld_th->depth;
 				}
 			}
 			svga3d->FIFOCommitAll();
 			m_provider->unlock3D();
 			mmap->release();
 			break;
+		case TEX_TYPE_VB:
+			/*
+			 * Vertex data follows a 128-byte header
+			 */
+			if (!tx->xfer.md || tx->xfer.md->getLength() <= 128U) {
+				rc = kIOReturnBadArgument;
+				goto clean1;
+			}
+			host_bytes = static_cast<uint32_t>(tx->xfer.md->getLength() - 128U);
+			rc = m_provider->createSurface(tx->surface_id,
+										   SVGA3dSurfaceFlags(SVGA3D_SURFACE_HINT_VERTEXBUFFER |
+															  SVGA3D_SURFACE_HINT_STATIC),
+										   SVGA3D_BUFFER,
+										   host_bytes,
+										   1U);
+			if (rc != kIOReturnSuccess) {
+				GLLog(1, "%s: createSurface return %#x\n", __FUNCTION__, rc);
+				goto clean1;
+			}
+			tx->vb_valid_bytes = 0U;
+			break;
 		default:
 			rc = kIOReturnUnsupported;
 			goto clean1;
 	}
+	m_shared->residentTexture(tx, host_bytes);
 	return kIOReturnSuccess;
 
 clean1:
@@ -870,6 +939,7 @@ IOReturn CLASS::alloc_and_load_texture(CEsvga2TextureBuffer* tx)
 	IOAccelBounds rect;
 	CEsvga2TextureBuffer* ltx;
 	GLDTextureHeader *headers, *gld_th;
+	bool host_mipmaps;
 
 	if (!m_provider)
 		return kIOReturnNotReady;
@@ -972,11 +1042,12 @@ IOReturn CLASS::alloc_and_load_texture(CEsvga2TextureBuffer* tx)
 			break;
 		case TEX_TYPE_STD:
 		case TEX_TYPE_OOB:
+			host_mipmaps = use_host_mipmaps(m_provider, tx, headers);
 			for (hostImage.face = 0U;
 				 hostImage.face != tx->num_faces;
 				 ++hostImage.face, headers += 12) {
 				for (gld_th = headers, hostImage.mipmap = 0U;
-					 hostImage.mipmap != tx->num_mipmaps;
+					 hostImage.mipmap != (host_mipmaps ? 1U : tx->num_mipmaps);
 					 ++hostImage.mipmap, ++gld_th) {
 					if (!gld_th->pixels_in_client ||
 						!isPagedOff(tx->sys_obj, hostImage.face, hostImage.mipmap))
@@ -1024,11 +1095,24 @@ IOReturn CLASS::alloc_and_load_texture(CEsvga2TextureBuffer* tx)
 				}
 			}
 			mmap->release();
+			if (host_mipmaps &&
+				m_provider->generateMipmaps(tx->surface_id, SVGA3D_TEX_FILTER_LINEAR) != kIOReturnSuccess) {
+				/*
+				 * Load the remaining levels next time
+				 */
+				for (hostImage.face = 0U; hostImage.face != tx->num_faces; ++hostImage.face)
+					tx->sys_obj->pageon[hostImage.face] |= tx->sys_obj->pageoff[hostImage.face] & 1U;
+				break;
+			}
 			for (hostImage.face = 0U; hostImage.face != tx->num_faces; ++hostImage.face)
 				tx->sys_obj->pageon[hostImage.face] |= tx->sys_obj->pageoff[hostImage.face];
 			break;
 	}
-	ltx->xfer.complete(m_provider); // ugh... to get rid of this need set up a garbage-collection mechanism
+	/*
+	 * Don't wait for the DMA.  The pages stay wired until
+	 *   its fence passes, see CEsvga2Shared::retireTextureUploads.
+	 */
+	ltx->xfer.retire(m_provider);
 	return kIOReturnSuccess;
 
 clean2:
@@ -1039,14 +1123,20 @@ clean1:
 	return rc;
 }
 
+/*
+ * Queues the update, merging it with the previous box when
+ *   both the destination and the source are contiguous.
+ *   The source is in the command buffer, so the queue must
+ *   be flushed before the texture is read or the command
+ *   buffer is released.
+ */
 HIDDEN
 IOReturn CLASS::tex_subimage_2d(CEsvga2TextureBuffer* tx,
 								struct GLDTexSubImage2DStruc const* desc)
 {
 	IOReturn rc;
-	SVGA3dCopyBox copyBox;
-	SVGA3dSurfaceImageId hostImage;
-	CEsvga2Accel::ExtraInfoEx extra;
+	SVGA3dCopyBox copyBox, *last;
+	vm_offset_t delta;
 
 	if (!tx || !desc || !tx->bytespp)
 		return kIOReturnBadArgument;
@@ -1056,41 +1146,92 @@ IOReturn CLASS::tex_subimage_2d(CEsvga2TextureBuffer* tx,
 		GLLog(1, "%s: invalid surface format\n", __FUNCTION__);
 		return kIOReturnNotReady;
 	}
+	if (!desc->source_pitch)
+		return kIOReturnBadArgument;
 #if LOGGING_LEVEL >= 1
 	if (tx->sys_obj_type == TEX_TYPE_SURFACE)
 		GLLog(1, "%s: called for surface texture\n", __FUNCTION__);
 #endif
-	bzero(&extra, sizeof extra);
-	extra.mem_offset_in_gmr = desc->source_addr;
-	extra.mem_pitch = desc->source_pitch;
-	extra.mem_limit = 0xFFFFFFFFU;
-	extra.suffix_flags = 2U;
-	bzero(&copyBox, sizeof copyBox);
-	copyBox.w = desc->width / tx->bytespp;
-	copyBox.h = desc->height;
-	copyBox.d = 1U;
-	copyBox.x = desc->dest_x / tx->bytespp;
-	copyBox.y = desc->dest_y;
-	copyBox.z = desc->dest_z;
-	hostImage.face = desc->face;
-	hostImage.mipmap = desc->mipmap;
 	rc = create_host_surface_for_texture(tx);
 	if (rc != kIOReturnSuccess) {
 		GLLog(1, "%s: create_host_surface_for_texture return %#x\n", __FUNCTION__, rc);
 		return rc;
 	}
-	hostImage.sid = tx->surface_id;
 	rc = m_command_buffer.xfer.prepare(m_provider);
 	if (rc != kIOReturnSuccess) {
 		GLLog(1, "%s: prepare_transfer_for_io return %#x\n", __FUNCTION__, rc);
 		return rc;
 	}
-	extra.mem_gmr_id = m_command_buffer.xfer.gmr_id;
-	return m_provider->surfaceDMA3DEx(&hostImage,
-									  SVGA3D_WRITE_HOST_VRAM,
-									  &copyBox,
-									  &extra,
-									  &m_command_buffer.xfer.fence);
+	if (m_tex_subimage.num_boxes &&
+		(m_tex_subimage.num_boxes == TEX_SUBIMAGE_MAX_BOXES ||
+		 m_tex_subimage.tx != tx ||
+		 m_tex_subimage.hostImage.sid != tx->surface_id ||
+		 m_tex_subimage.hostImage.face != desc->face ||
+		 m_tex_subimage.hostImage.mipmap != desc->mipmap ||
+		 m_tex_subimage.extra.mem_pitch != desc->source_pitch ||
+		 m_tex_subimage.extra.mem_gmr_id != m_command_buffer.xfer.gmr_id ||
+		 desc->source_addr < m_tex_subimage.extra.mem_offset_in_gmr ||
+		 (desc->source_addr - m_tex_subimage.extra.mem_offset_in_gmr) % desc->source_pitch % tx->bytespp))
+		flush_tex_subimage_2d();
+	if (!m_tex_subimage.num_boxes) {
+		m_tex_subimage.tx = tx;
+		m_tex_subimage.hostImage.sid = tx->surface_id;
+		m_tex_subimage.hostImage.face = desc->face;
+		m_tex_subimage.hostImage.mipmap = desc->mipmap;
+		bzero(&m_tex_subimage.extra, sizeof m_tex_subimage.extra);
+		m_tex_subimage.extra.mem_offset_in_gmr = desc->source_addr;
+		m_tex_subimage.extra.mem_pitch = desc->source_pitch;
+		m_tex_subimage.extra.mem_limit = 0xFFFFFFFFU;
+		m_tex_subimage.extra.mem_gmr_id = m_command_buffer.xfer.gmr_id;
+		m_tex_subimage.extra.suffix_flags = 2U;
+	}
+	delta = desc->source_addr - m_tex_subimage.extra.mem_offset_in_gmr;
+	bzero(&copyBox, sizeof copyBox);
+	copyBox.w = desc->width / tx->bytespp;
+	copyBox.h = desc->height;
+	copyBox.d = 1U;
+	copyBox.x = desc->dest_x / tx->bytespp;
+	copyBox.y = desc->dest_y;
+	copyBox.z = desc->dest_z;
+	copyBox.srcx = static_cast<uint32_t>((delta % desc->source_pitch) / tx->bytespp);
+	copyBox.srcy = static_cast<uint32_t>(delta / desc->source_pitch);
+	if (!copyBox.w || !copyBox.h)
+		return kIOReturnSuccess;
+	if (m_tex_subimage.num_boxes) {
+		last = &m_tex_subimage.boxes[m_tex_subimage.num_boxes - 1U];
+		if (last->z == copyBox.z &&
+			last->x == copyBox.x && last->w == copyBox.w &&
+			last->y + last->h == copyBox.y &&
+			last->srcx == copyBox.srcx && last->srcy + last->h == copyBox.srcy) {
+			last->h += copyBox.h;
+			return kIOReturnSuccess;
+		}
+		if (last->z == copyBox.z &&
+			last->y == copyBox.y && last->h == copyBox.h &&
+			last->x + last->w == copyBox.x &&
+			last->srcy == copyBox.srcy && last->srcx + last->w == copyBox.srcx) {
+			last->w += copyBox.w;
+			return kIOReturnSuccess;
+		}
+	}
+	memcpy(&m_tex_subimage.boxes[m_tex_subimage.num_boxes], &copyBox, sizeof copyBox);
+	++m_tex_subimage.num_boxes;
+	return kIOReturnSuccess;
+}
+
+HIDDEN
+void CLASS::flush_tex_subimage_2d(void)
+{
+	if (!m_tex_subimage.num_boxes)
+		return;
+	m_provider->surfaceDMA3DEx(&m_tex_subimage.hostImage,
+							   SVGA3D_WRITE_HOST_VRAM,
+							   &m_tex_subimage.boxes[0],
+							   m_tex_subimage.num_boxes,
+							   &m_tex_subimage.extra,
+							   &m_command_buffer.xfer.fence);
+	m_tex_subimage.num_boxes = 0U;
+	m_tex_subimage.tx = 0;
 }
 
 HIDDEN
@@ -1150,6 +1291,102 @@ void CLASS::setup_drawbuffer_registers(uint32_t* p)
 	memcpy(&p[7], &m_drawrect[0], sizeof m_drawrect);
 }
 
+/*
+ * Finds the host image pixels are read from, the ReadFBO's
+ *   color attachment if one is bound, else the drawable's
+ *   color buffer (whose format isn't known here).
+ */
+HIDDEN
+bool CLASS::get_read_image(SVGA3dSurfaceImageId* image, int* surface_format)
+{
+	uint32_t gart_pitch;
+
+	bzero(image, sizeof *image);
+	image->sid = SVGA_ID_INVALID;
+	*surface_format = SVGA3D_FORMAT_INVALID;
+	if (m_fbo[1]) {
+		if (!m_txs[19])
+			return false;
+		get_tex_data(m_txs[19], &image->sid, &gart_pitch, 0);
+		image->face = m_fbo[1]->txs[0].face;
+		image->mipmap = m_fbo[1]->txs[0].mipmap;
+		*surface_format = m_txs[19]->surface_format;
+	} else if (m_surface_client) {
+		if (!m_surface_client->getSurfacesForGL(&image->sid, 0))
+			return false;
+	}
+	return isIdValid(image->sid);
+}
+
+/*
+ * Copies a rectangle of pixels on the host to the destination
+ *   set by CopyPixelsDst.  Matching formats use SurfaceCopy,
+ *   anything else a same-size SurfaceStretchBlt, which converts.
+ */
+HIDDEN
+void CLASS::copy_pixels(SVGA3dSurfaceImageId const* srcImage, int src_format, uint32_t src_xy, uint32_t size)
+{
+	CEsvga2TextureBuffer* tx;
+	SVGA3dSurfaceImageId dstImage;
+	SVGA3dCopyBox copyBox;
+	SVGA3dBox srcBox, dstBox;
+	uint32_t gart_pitch;
+	IOReturn rc;
+
+	if (!m_copy_dst.valid) {
+		GLLog(1, "%s: no destination\n", __FUNCTION__);
+		return;
+	}
+	tx = m_shared->findTextureBuffer(m_copy_dst.object_id);
+	if (!tx)
+		return;
+	bzero(&dstImage, sizeof dstImage);
+	get_tex_data(tx, &dstImage.sid, &gart_pitch, 0);
+	if (!isIdValid(dstImage.sid))
+		return;
+	dstImage.face = m_copy_dst.face;
+	dstImage.mipmap = m_copy_dst.mipmap;
+	bzero(&copyBox, sizeof copyBox);
+	copyBox.x = m_copy_dst.x;
+	copyBox.y = m_copy_dst.y;
+	copyBox.w = size & 0xFFFFU;
+	copyBox.h = size >> 16;
+	copyBox.d = 1U;
+	copyBox.srcx = src_xy & 0xFFFFU;
+	copyBox.srcy = src_xy >> 16;
+	if (!copyBox.w || !copyBox.h)
+		return;
+#if LOGGING_LEVEL >= 3
+	GLLog(3, "%s: %u[%u, %u] (%u, %u) -> %u[%u, %u] (%u, %u), %u x %u\n", __FUNCTION__,
+		  srcImage->sid, srcImage->face, srcImage->mipmap, copyBox.srcx, copyBox.srcy,
+		  dstImage.sid, dstImage.face, dstImage.mipmap, copyBox.x, copyBox.y,
+		  copyBox.w, copyBox.h);
+#endif
+	if (src_format != SVGA3D_FORMAT_INVALID &&
+		src_format == tx->surface_format)
+		rc = m_provider->surfaceCopy(srcImage, &dstImage, &copyBox, 1U);
+	else {
+		srcBox.x = copyBox.srcx;
+		srcBox.y = copyBox.srcy;
+		srcBox.z = 0U;
+		srcBox.w = copyBox.w;
+		srcBox.h = copyBox.h;
+		srcBox.d = 1U;
+		dstBox.x = copyBox.x;
+		dstBox.y = copyBox.y;
+		dstBox.z = 0U;
+		dstBox.w = copyBox.w;
+		dstBox.h = copyBox.h;
+		dstBox.d = 1U;
+		rc = m_provider->surfaceStretch(srcImage, &dstImage, SVGA3D_STRETCH_BLT_POINT, &srcBox, &dstBox);
+	}
+	if (rc != kIOReturnSuccess) {
+		GLLog(1, "%s: copy return %#x\n", __FUNCTION__, rc);
+		return;
+	}
+	dirtyTexture(tx, m_copy_dst.face, m_copy_dst.mipmap);
+}
+
 #pragma mark -
 #pragma mark Dispatch Funtions [Apple]
 #pragma mark -
@@ -1168,6 +1405,8 @@ void CLASS::process_token_TextureVolatile(VendorGLStreamInfo* info)
 		m_stream_error = 2;
 		return;
 	}
+	if (q & 0x10U)
+		m_shared->syncTextureUpload(tx);
 	switch (tx->sys_obj_type) {
 		case TEX_TYPE_STD:
 			tx->sys_obj->vstate |= static_cast<uint8_t>(q);
@@ -1732,6 +1971,14 @@ void CLASS::process_token_Texture(VendorGLStreamInfo* info)
 #if 1
 	this->0x23C = count;
 #endif
+	/*
+	 * Make room on the host, keeping whatever this context
+	 *   has bound or used in the current command buffer
+	 */
+	for (i = 0U; i != 21U; ++i)
+		if (m_txs[i])
+			m_shared->touchTexture(m_txs[i]);
+	m_shared->evictTextures(m_texture_epoch);
 	if (count)
 		*p = 0x7D000000U | (3U * count); /* 3DSTATE_MAP_STATE */
 	else
@@ -1778,19 +2025,21 @@ HIDDEN
 void CLASS::process_token_VertexBuffer(VendorGLStreamInfo* info)
 {
 	CEsvga2TextureBuffer* tx;
+	IOReturn rc;
 
-	GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+	GLLog(3, "%s(%u)\n", __FUNCTION__, info->p[1]);
 	tx = m_shared->findTextureBuffer(info->p[1]);
 	if (!tx) {
 		info->cmd = 0U;
 		info->ds_count_dwords = 0;
-#if 1
-		m_provider->0x50 -= info->f2;
-#endif
 		m_stream_error = 2;
 		return;
 	}
 	if (tx != m_txs[16]) {
+		/*
+		 * Primitives so far refer to the previous vertex buffer
+		 */
+		submit_midbuffer(info);
 		if (m_txs[16]) {
 			m_txs[16]->sys_obj->stamps[0] = 0U /* m_provider->0x50 */;
 			--m_txs[16]->xfer.counter14;
@@ -1798,21 +2047,21 @@ void CLASS::process_token_VertexBuffer(VendorGLStreamInfo* info)
 		++tx->xfer.counter14;
 		m_txs[16] = tx;
 	}
-	if (!m_txs[16]->xfer.gart_ptr) {
-		submit_midbuffer(info);
-#if 1
-		mapTransferToGART(&tx.xfer);
-		if (!m_command_buffer.xfer.gart_ptr)
-			mapTransferToGART(&m_command_buffer.xfer);
-#endif
-	}
-#if 1
-	info->p[0] = 0x4CU; // TBD... strange doesn't look like an opcode, maybe middle of an Intel CMD
-	info->p[1] = tx->xfer.gart_ptr + 128U;	// Looks like this is a gart_ptr for a TEX_TYPE_VB texture with offset 0x80
-#else
+	/*
+	 * Vertex data is kept on the host in the buffer's own surface,
+	 *   which the IPP draws from and refreshes when it's rewritten
+	 */
+	rc = create_host_surface_for_texture(tx);
+	if (rc != kIOReturnSuccess)
+		GLLog(1, "%s: create_host_surface_for_texture return %#x\n", __FUNCTION__, rc);
+	/*
+	 * Nothing is mapped into a GART here, so S0 addresses are taken
+	 *   as byte offsets into the vertex data, which starts past the
+	 *   0x80 byte header of a TEX_TYPE_VB buffer (see CEsvga2Shared::new_texture)
+	 */
+	m_ipp->set_vertex_buffer(tx, 0x80U, 0U);
 	info->p[0] = 0U;
 	info->p[1] = 0U;
-#endif
 }
 
 /*
@@ -1821,17 +2070,15 @@ void CLASS::process_token_VertexBuffer(VendorGLStreamInfo* info)
 HIDDEN
 void CLASS::process_token_NoVertexBuffer(VendorGLStreamInfo* info)
 {
-	GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+	GLLog(3, "%s()\n", __FUNCTION__);
 	if (m_txs[16]) {
+		submit_midbuffer(info);
+		m_ipp->set_vertex_buffer(0, 0U, 0U);
 		m_txs[16]->sys_obj->stamps[0] = 0U /* m_provider->0x50 */;
 		--m_txs[16]->xfer.counter14;
 		m_txs[16] = 0;
 	}
-#if 1
-	info->p[0] = 0x4CU;	// TBD... and again
-#else
 	info->p[0] = 0U;
-#endif
 }
 
 HIDDEN
@@ -1967,20 +2214,34 @@ void CLASS::process_token_TexSubImage2D(VendorGLStreamInfo* info)
 	bzero(&info->p[0], 9U * sizeof(uint32_t));
 #endif
 	removeTextureFromStream(tx);
-	if (__sync_fetch_and_add(&tx->sys_obj->refcount, -0x10000) == 0x10000)
+	if (__sync_fetch_and_add(&tx->sys_obj->refcount, -0x10000) == 0x10000) {
+		flush_tex_subimage_2d();
 		m_shared->delete_texture(tx);
+	}
 }
 
+/*
+ * Note: token layouts for the CopyPixels group, as far as known
+ *   CopyPixelsDst     p[1] texture, p[2] x [bytes] | y << 16,
+ *                     p[4] face << 16 | mipmap
+ *   CopyPixelsSrc     p[1] x | y << 16, p[2] width | height << 16
+ *   CopyPixelsSrcFBO  p[1] texture, p[2] x | y << 16,
+ *                     p[3] width | height << 16, p[4] face << 16 | mipmap
+ *   Apple's kernel then has the GPU draw a textured quad.  Here
+ *   the host copies the pixels, and the quad's floats are ignored.
+ * Note: these layouts have not been checked against token dumps, so the
+ *   host copies are only done with -ce1_gl_host_copies.  Otherwise the
+ *   tokens are dropped as before, and dumped at log level 3.
+ */
 HIDDEN
 void CLASS::process_token_CopyPixelsDst(VendorGLStreamInfo* info)
 {
 	CEsvga2TextureBuffer* tx;
+	uint8_t face, mipmap;
 #if 1
 	uint32_t gart_ptr, gart_pitch;
-	uint8_t face, mipmap;
 #endif
 
-	GLLog(1, "%s() Unsupported\n", __FUNCTION__);
 	tx = m_shared->findTextureBuffer(info->p[1]);
 	if (!tx) {
 		info->cmd = 0U;
@@ -1993,13 +2254,34 @@ void CLASS::process_token_CopyPixelsDst(VendorGLStreamInfo* info)
 	}
 #if 1
 	addTextureToStream(tx);
-	get_texture(info, tx, true);
-	face = info->p[4] >> 16;
-	mipmap = info->p[4] & 0xFFFFU;
-	if (face >= 6U)
-		face = 0U;
-	if (mipmap >= 16U)
-		mipmap = 0U;
+#endif
+	face = sanitize_face(info->p[4] >> 16);
+	mipmap = sanitize_mipmap(info->p[4] & 0xFFFFU);
+	GLLog(3, "%s: %#x %#x %#x %#x\n", __FUNCTION__,
+		  info->p[1], info->p[2], info->p[3], info->p[4]);
+	if (!checkOptionAC(CE1_OPTION_AC_GL_HOST_COPIES)) {
+		GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+#if 1
+		get_texture(info, tx, true);
+#endif
+	} else {
+		if (tx->surface_format == SVGA3D_FORMAT_INVALID)
+			tx->surface_format = select_default_format(tx, 0);
+		get_texture(info, tx, true);
+		/*
+		 * As in BindDrawFBO, the host texture must exist
+		 *   even if there was nothing to load into it
+		 */
+		if (!isIdValid(tx->surface_id))
+			create_host_surface_for_texture(tx);
+		m_copy_dst.object_id = info->p[1];
+		m_copy_dst.x = (info->p[2] & 0xFFFFU) / (tx->bytespp ? tx->bytespp : 1U);
+		m_copy_dst.y = info->p[2] >> 16;
+		m_copy_dst.face = face;
+		m_copy_dst.mipmap = mipmap;
+		m_copy_dst.valid = true;
+	}
+#if 1
 	dirtyTexture(tx, face, mipmap);
 	get_tex_data(tx, &gart_ptr, &gart_pitch, 0);
 	gart_ptr += (info->p[2] & 0xFFFFU) + (info->p[2] >> 16) * gart_pitch;
@@ -2021,23 +2303,58 @@ void CLASS::process_token_CopyPixelsDst(VendorGLStreamInfo* info)
 HIDDEN
 void CLASS::process_token_CopyPixelsSrc(VendorGLStreamInfo* info)
 {
-	GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+	SVGA3dSurfaceImageId srcImage;
+	int src_format;
+
 	/*
 	 * Note: also sets info->p[11] thru info->p[26] to a bunch of floats.
 	 *   This function copies pixels from the render target.
 	 */
+	GLLog(3, "%s: %#x %#x %#x %#x\n", __FUNCTION__,
+		  info->p[1], info->p[2], info->p[3], info->p[4]);
+	if (!checkOptionAC(CE1_OPTION_AC_GL_HOST_COPIES)) {
+		GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+		goto done;
+	}
+	submit_midbuffer(info);	// so the pixels are drawn first
+	if (get_read_image(&srcImage, &src_format))
+		copy_pixels(&srcImage, src_format, info->p[1], info->p[2]);
+	else
+		GLLog(1, "%s: no read buffer\n", __FUNCTION__);
+	m_copy_dst.valid = false;	// each destination is used once
+done:
 	bzero(&info->p[0], 5U * sizeof(uint32_t));
 }
 
 HIDDEN
 void CLASS::process_token_CopyPixelsSrcFBO(VendorGLStreamInfo* info)
 {
-	GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+	CEsvga2TextureBuffer* tx;
+	SVGA3dSurfaceImageId srcImage;
+	uint32_t gart_pitch;
+
 	/*
 	 * Note: also sets info->p[11] thru info->p[26] to a bunch of floats.
 	 * Note: There's a texture reference at info->p[1] in this command,
 	 *   and it's not released... looks like a leak in Apple's code.
 	 */
+	GLLog(3, "%s: %#x %#x %#x %#x\n", __FUNCTION__,
+		  info->p[1], info->p[2], info->p[3], info->p[4]);
+	if (!checkOptionAC(CE1_OPTION_AC_GL_HOST_COPIES)) {
+		GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+		tx = 0;
+	} else
+		tx = m_shared->findTextureBuffer(info->p[1]);
+	if (tx) {
+		submit_midbuffer(info);
+		bzero(&srcImage, sizeof srcImage);
+		get_tex_data(tx, &srcImage.sid, &gart_pitch, 0);
+		srcImage.face = sanitize_face(info->p[4] >> 16);
+		srcImage.mipmap = sanitize_mipmap(info->p[4] & 0xFFFFU);
+		if (isIdValid(srcImage.sid))
+			copy_pixels(&srcImage, tx->surface_format, info->p[2], info->p[3]);
+	}
+	m_copy_dst.valid = false;	// each destination is used once
 	discard_token_CopyPixelsDst(info);	// plug the leak - discards a texture reference @ info->p[1]
 	bzero(&info->p[0], 5U * sizeof(uint32_t));
 }
@@ -2049,10 +2366,76 @@ void CLASS::process_token_DrawRect(VendorGLStreamInfo* info)
 	memcpy(&info->p[1], &m_drawrect[0], sizeof m_drawrect);
 }
 
+/*
+ * Reads the read buffer into a client buffer object with a surface DMA,
+ *   without waiting for it.  The buffer's fence is kept in its xfer,
+ *   which syncTextureUpload waits on and retireTextureUploads retires.
+ *   The buffer is marked dirty, so the client's page-off of it goes
+ *   through pageoffDirtyTexture, which waits on the fence.
+ * Note: layout as far as known
+ *   p[1] buffer, p[2] x | y << 16, p[3] width | height << 16,
+ *   p[4] pitch [bytes], p[5] offset into buffer data [bytes]
+ *   As with CopyPixels, this is only done with -ce1_gl_host_copies.
+ */
 HIDDEN
 void CLASS::process_token_AsyncReadDrawBuffer(VendorGLStreamInfo* info)
 {
-	GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+	CEsvga2TextureBuffer* tx;
+	SVGA3dSurfaceImageId srcImage;
+	SVGA3dCopyBox copyBox;
+	CEsvga2Accel::ExtraInfoEx extra;
+	IOByteCount length;
+	IOReturn rc;
+	int src_format;
+
+	GLLog(3, "%s: %#x %#x %#x %#x %#x\n", __FUNCTION__,
+		  info->p[1], info->p[2], info->p[3], info->p[4], info->p[5]);
+	if (!checkOptionAC(CE1_OPTION_AC_GL_HOST_COPIES)) {
+		GLLog(1, "%s() Unsupported\n", __FUNCTION__);
+		goto done;
+	}
+	tx = m_shared->findTextureBuffer(info->p[1]);
+	if (!tx || tx->sys_obj_type != TEX_TYPE_VB || !tx->xfer.md)
+		goto done;
+	if (!get_read_image(&srcImage, &src_format)) {
+		GLLog(1, "%s: no read buffer\n", __FUNCTION__);
+		goto done;
+	}
+	bzero(&copyBox, sizeof copyBox);
+	copyBox.x = info->p[2] & 0xFFFFU;
+	copyBox.y = info->p[2] >> 16;
+	copyBox.w = info->p[3] & 0xFFFFU;
+	copyBox.h = info->p[3] >> 16;
+	copyBox.d = 1U;
+	extra.mem_offset_in_gmr = info->p[5] + 128U;	// data follows the header
+	extra.mem_pitch = info->p[4];
+	length = tx->xfer.md->getLength();
+	if (!copyBox.w || !copyBox.h ||
+		extra.mem_offset_in_gmr + copyBox.h * extra.mem_pitch > length) {
+		GLLog(1, "%s: bad read of %u x %u, pitch %u\n", __FUNCTION__,
+			  copyBox.w, copyBox.h, info->p[4]);
+		goto done;
+	}
+	extra.mem_limit = length - extra.mem_offset_in_gmr;
+	extra.suffix_flags = 2U;
+	submit_midbuffer(info);	// so the pixels are drawn first
+	rc = tx->xfer.prepare(m_provider);
+	if (rc != kIOReturnSuccess) {
+		GLLog(1, "%s: prepare return %#x\n", __FUNCTION__, rc);
+		goto done;
+	}
+	extra.mem_gmr_id = tx->xfer.gmr_id;
+	rc = m_provider->surfaceDMA3DEx(&srcImage,
+									SVGA3D_READ_HOST_VRAM,
+									&copyBox,
+									&extra,
+									&tx->xfer.fence);
+	if (rc != kIOReturnSuccess) {
+		GLLog(1, "%s: surfaceDMA3DEx return %#x\n", __FUNCTION__, rc);
+		goto done;
+	}
+	dirtyTexture(tx, 0, 0);
+done:
 	discard_token_AsyncReadDrawBuffer(info);
 }
 
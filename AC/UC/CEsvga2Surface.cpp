@@ -576,9 +576,11 @@ bool CLASS::allocBacking()
 			break;
 	}
 	m_backing.size = m_scale.reserved[0];
-	m_backing.self = static_cast<uint8_t*>(m_provider->VRAMRealloc(m_backing.self, m_backing.size));
-	if (!m_backing.self)
+	m_backing.self = static_cast<uint8_t*>(m_provider->VRAMRealloc(m_backing.self, m_backing.size, CEsvga2Accel::kVRAMTagSurfaceBacking));
+	if (!m_backing.self) {
+		m_provider->VRAMFallbackToGMR(CEsvga2Accel::kVRAMTagSurfaceBacking);
 		return allocGMRBacking();
+	}
 	m_backing.offset = reinterpret_cast<vm_offset_t>(m_backing.self) - CLIENT_ADDR_TO_UINTPTR_T(m_screenInfo.client_addr);
 	SFLog(2, "%s[%#x]: m_backing.offset is %#lx\n", __FUNCTION__, m_wID, FMT_LU(m_backing.offset));
 	m_backing.vtb.gmr_id = GMR_VRAM();
@@ -616,7 +618,7 @@ void CLASS::releaseBacking()
 	m_backing.vtb.complete(m_provider);
 	m_backing.vtb.discard();
 	if (m_provider != 0 && m_backing.self != 0)
-		m_provider->VRAMFree(m_backing.self);
+		m_provider->VRAMFree(m_backing.self, CEsvga2Accel::kVRAMTagSurfaceBacking);
 	bzero(&m_backing, sizeof m_backing);
 	m_backing.vtb.init();
 }
@@ -723,7 +725,7 @@ IOReturn CLASS::detectBlitBug()
 								   h);
 	if (rc != kIOReturnSuccess)
 		return kIOReturnError;
-	ptr = static_cast<uint32_t*>(m_provider->VRAMMalloc(PAGE_SIZE));
+	ptr = static_cast<uint32_t*>(m_provider->VRAMMalloc(PAGE_SIZE, CEsvga2Accel::kVRAMTagScratch));
 	if (!ptr) {
 		rc = kIOReturnNoMemory;
 		goto exit;
@@ -256,6 +256,7 @@ public:
 	uint8_t getBytesPerPixel() const { return m_bytes_per_pixel; }
 	void getBoundsForGL(uint32_t* inner_width, uint32_t* inner_height, uint32_t* outer_width, uint32_t* outer_height) const;
 	bool getSurfacesForGL(uint32_t* color_sid, uint32_t* depth_sid) const;
+	int getDepthStencilFormat() const { return m_gl.ds_format; }
 	IOReturn attachGL(int cmb);
 	IOReturn resizeGL();
 	IOReturn detachGL();
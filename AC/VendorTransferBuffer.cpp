@@ -57,27 +57,25 @@ IOReturn CLASS::prepare(CEsvga2Accel* provider)
 		return kIOReturnSuccess;
 	if (!md)
 		return kIOReturnNotReady;
-	gmr_id = provider->AllocGMRID();
-	if (!isIdValid(gmr_id)) {
+	rc = md->prepare();
+	if (rc != kIOReturnSuccess)
+		return rc;
+	/*
+	 * Note: GMRs are looked up in the accelerator's cache,
+	 *   so repeated transfers from the same pages don't
+	 *   redefine the GMR each time.
+	 */
+	rc = provider->acquireGMR(md, &gmr_id);
+	if (rc != kIOReturnSuccess) {
 #if 1
-		IOLog("%s: Out of GMR IDs\n", __FUNCTION__);
+		if (rc == kIOReturnNoResources)
+			IOLog("%s: Out of GMR IDs\n", __FUNCTION__);
 #endif
-		return kIOReturnNoResources;
+		md->complete();
+		gmr_id = SVGA_ID_INVALID;
+		return rc;
 	}
-	rc = md->prepare();
-	if (rc != kIOReturnSuccess)
-		goto clean1;
-	rc = provider->createGMR(gmr_id, md);
-	if (rc != kIOReturnSuccess)
-		goto clean2;
 	return kIOReturnSuccess;
-
-clean2:
-	md->complete();
-clean1:
-	provider->FreeGMRID(gmr_id);
-	gmr_id = SVGA_ID_INVALID;
-	return rc;
 }
 
 HIDDEN
@@ -92,16 +90,33 @@ void CLASS::sync(CEsvga2Accel* provider)
 HIDDEN
 void CLASS::complete(CEsvga2Accel* provider)
 {
+	if (provider && isIdValid(gmr_id))
+		provider->releaseGMR(gmr_id, fence);
 	sync(provider);
 	if (!provider || !isIdValid(gmr_id))
 		return;
-	provider->destroyGMR(gmr_id);
 	if (md)
 		md->complete();
-	provider->FreeGMRID(gmr_id);
 	gmr_id = SVGA_ID_INVALID;
 }
 
+/*
+ * Completes the transfer only if its fence has passed,
+ *   otherwise the GMR stays wired for a later retire()
+ *   or complete().
+ */
+HIDDEN
+bool CLASS::retire(CEsvga2Accel* provider)
+{
+	if (!isIdValid(gmr_id))
+		return true;
+	if (!provider ||
+		(fence && !provider->HasFencePassed(fence)))
+		return false;
+	complete(provider);
+	return true;
+}
+
 HIDDEN
 void CLASS::discard(void)
 {
@@ -36,6 +36,7 @@ struct VendorTransferBuffer {
 	IOReturn prepare(class CEsvga2Accel* provider);
 	void sync(class CEsvga2Accel* provider);
 	void complete(class CEsvga2Accel* provider);
+	bool retire(class CEsvga2Accel* provider);
 	void discard(void);
 };
 
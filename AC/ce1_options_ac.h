@@ -33,6 +33,9 @@
 #define CE1_OPTION_AC_QE					0x0100
 #define CE1_OPTION_AC_PACKED_BACKING		0x0200
 #define CE1_OPTION_AC_REGION_BOUNDS_COPY	0x0400
+#define CE1_OPTION_AC_HOST_MIPMAPS			0x0800
+#define CE1_OPTION_AC_GL_HOST_COPIES		0x1000
+#define CE1_OPTION_AC_GL_TRANSLATE_PS		0x2000
 
 #ifdef __cplusplus
 extern "C" {
@@ -828,3 +828,58 @@ bool CLASS::remapGMR2(uint32_t gmrId, uint32_t flags, uint32_t offsetPages,
 	FIFOCommitAll();
 	return true;
 }
+
+/*
+ * Emits as many remaps as needed to fit the FIFO.  Each remap
+ *   uses PPN32 unless it starts with a page above the 32-bit
+ *   PPN range, in which case it's encoded as PPN64.
+ */
+bool CLASS::remapGMR2PPNs(uint32_t gmrId, uint32_t offsetPages,
+						  uint32_t numPages, uint64_t const* ppns)
+{
+	SVGAFifoCmdRemapGMR2* cmd;
+	uint32_t *ppn32, count, i;
+	bool ppn64;
+
+	if (!HasCapability(SVGA_CAP_GMR2))
+		return false;
+	while (numPages) {
+		count = numPages;
+		if (count > getMaxRemapGMR2Pages(false))
+			count = getMaxRemapGMR2Pages(false);
+		for (i = 0U; i != count; ++i)
+			if (ppns[i] >> 32)
+				break;
+		ppn64 = (i == 0U);
+		if (!ppn64)
+			count = i;
+		else if (count > getMaxRemapGMR2Pages(true))
+			count = getMaxRemapGMR2Pages(true);
+		cmd = static_cast<SVGAFifoCmdRemapGMR2*>(FIFOReserveCmd(SVGA_CMD_REMAP_GMR2,
+																sizeof *cmd + count * (ppn64 ? sizeof(uint64_t) : sizeof(uint32_t))));
+		if (!cmd)
+			return false;
+		cmd->gmrId = gmrId;
+		cmd->flags = ppn64 ? SVGA_REMAP_GMR2_PPN64 : SVGA_REMAP_GMR2_PPN32;
+		cmd->offsetPages = offsetPages;
+		cmd->numPages = count;
+		if (ppn64)
+			memcpy(&cmd[1], ppns, count * sizeof(uint64_t));
+		else {
+			ppn32 = reinterpret_cast<uint32_t*>(&cmd[1]);
+			for (i = 0U; i != count; ++i)
+				ppn32[i] = static_cast<uint32_t>(ppns[i]);
+		}
+		FIFOCommitAll();
+		ppns += count;
+		offsetPages += count;
+		numPages -= count;
+	}
+	return true;
+}
+
+uint32_t CLASS::getMaxRemapGMR2Pages(bool ppn64)
+{
+	return static_cast<uint32_t>((BOUNCE_BUFFER_SIZE - sizeof(uint32_t) - sizeof(SVGAFifoCmdRemapGMR2)) /
+								 (ppn64 ? sizeof(uint64_t) : sizeof(uint32_t)));
+}
@@ -145,6 +145,9 @@ public:
 	bool defineGMR2(uint32_t gmrId, uint32_t numPages);
 	bool remapGMR2(uint32_t gmrId, uint32_t flags, uint32_t offsetPages,
 				   uint32_t numPages, void const* suffix, size_t suffixSize);
+	bool remapGMR2PPNs(uint32_t gmrId, uint32_t offsetPages,
+					   uint32_t numPages, uint64_t const* ppns);	// picks PPN32 or PPN64 for each remap
+	static uint32_t getMaxRemapGMR2Pages(bool ppn64 = false);	// max entries that fit in a single remapGMR2
 };
 
 #endif /* __SVGADEVICE_H__ */